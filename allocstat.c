@@ -0,0 +1,68 @@
+/*
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+* allocstat.c
+*
+* Heap allocation counter, built in with make ALLOCSTAT=1.
+* Replaces malloc, calloc, realloc and free with versions which count the calls made
+* by each thread, and pass them on to the glibc allocator. Every allocation made by the
+* program and the libraries it uses, including strdup and libxPL, goes through these.
+*
+*/
+
+#include <stddef.h>
+#include "allocstat.h"
+
+/* The glibc allocator */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static __thread unsigned allocs = 0;
+
+/*
+* Return the number of allocations made by the calling thread
+*/
+
+unsigned allocstat_count(void)
+{
+	return allocs;
+}
+
+void *malloc(size_t size)
+{
+	allocs++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
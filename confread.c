@@ -295,7 +295,7 @@ SectionEntryPtr_t confreadFindSection(ConfigEntryPtr_t ce, const String section)
 
 const String confreadGetSection(SectionEntryPtr_t se)
 {
-	if((!se) || (se->magic != KE_MAGIC) || (!se->section))
+	if((!se) || (se->magic != SE_MAGIC) || (!se->section))
 		return NULL;
 	return se->section;
 }
@@ -0,0 +1,247 @@
+/*
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+* linebench.c
+*
+* Times splitting RC-65 bus traffic into lines, comparing the byte at a time delimiter loop
+* serio.c used to have with serio_rx_line(), the memchr() scan it has now.
+*
+* The traffic file has one line per response as received from the bus. Lines starting with
+* a # are comments. Each newline is turned back into the return the thermostats end lines
+* with. The traffic is fed to the receive buffer in chunks of the sizes given, the way reads
+* from the serial port return it.
+*
+* Usage: linebench traffic-file [chunk-size ...]
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "types.h"
+#include "serio.h"
+
+#define BENCH_BYTES	(64 * 1024 * 1024)	/* Traffic fed through each splitter per chunk size */
+
+char *progName = "linebench"; /* For notify.c */
+int debugLvl = 0;
+
+static char *traffic;
+static unsigned trafficLen;
+static char lineBuf[SERIO_MAX_LINE];
+
+/*
+* Return monotonic time in ns
+*/
+
+static uint64_t nowNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/*
+* Load the traffic file, without the comment lines and with each newline replaced by a return
+*/
+
+static Bool loadTraffic(const char *path)
+{
+	FILE *f;
+	long size;
+	unsigned i, j;
+	Bool comment = FALSE, bol = TRUE;
+
+	if(!(f = fopen(path, "rb")))
+		return FALSE;
+	if((fseek(f, 0, SEEK_END)) || ((size = ftell(f)) <= 0) || (fseek(f, 0, SEEK_SET))){
+		fclose(f);
+		return FALSE;
+	}
+	if(!(traffic = malloc(size)) || (fread(traffic, 1, size, f) != (size_t) size)){
+		fclose(f);
+		return FALSE;
+	}
+	fclose(f);
+	for(i = j = 0; i < (unsigned) size; i++){
+		if(bol)
+			comment = (traffic[i] == '#') ? TRUE : FALSE;
+		bol = (traffic[i] == '\n') ? TRUE : FALSE;
+		if(!comment)
+			traffic[j++] = (traffic[i] == '\n') ? '\r' : traffic[i];
+	}
+	trafficLen = j;
+	return (trafficLen) ? TRUE : FALSE;
+}
+
+/*
+* Move the unconsumed bytes down, then append the next chunk of traffic, as rx_fill() does
+* with a read from the port. Returns the number of bytes appended.
+*/
+
+static unsigned fill(serioStuffPtr_t serio, unsigned chunk, unsigned *pos)
+{
+	unsigned count = serio->tail - serio->head;
+
+	if(serio->head){
+		if(count)
+			memmove(serio->rxbuf, serio->rxbuf + serio->head, count);
+		serio->scan -= serio->head;
+		serio->head = 0;
+		serio->tail = count;
+	}
+	if(chunk > SERIO_RX_SIZE - serio->tail)
+		chunk = SERIO_RX_SIZE - serio->tail;
+	if(chunk > trafficLen - *pos)
+		chunk = trafficLen - *pos;
+	memcpy(serio->rxbuf + serio->tail, traffic + *pos, chunk);
+	serio->tail += chunk;
+	*pos = (*pos + chunk == trafficLen) ? 0 : *pos + chunk;
+	return chunk;
+}
+
+/*
+* rx_line() before the memchr() change: checks one byte at a time from the start of the
+* unconsumed bytes on every call, and copies the line out to a line buffer.
+*/
+
+static Bool lineBytes(serioStuffPtr_t serio, char delim, Bool strip_cr)
+{
+	unsigned i, pos;
+	char c;
+
+	for(i = serio->head; i < serio->tail; i++){
+		if(serio->rxbuf[i] != delim)
+			continue;
+
+		if(serio->discard){ /* Tail end of an overlong line */
+			serio->discard = FALSE;
+			serio->head = i + 1;
+			continue;
+		}
+
+		if((i - serio->head) >= SERIO_MAX_LINE){ /* Line won't fit in the line buffer */
+			serio->head = i + 1;
+			continue;
+		}
+
+		for(pos = 0; serio->head < i; serio->head++){
+			c = serio->rxbuf[serio->head];
+			if(strip_cr && (c == '\r'))
+				continue;
+			serio->line[pos++] = c;
+		}
+		serio->line[pos] = 0;
+		serio->len = pos;
+		serio->head = i + 1;
+		return TRUE;
+	}
+
+	/* No delimiter. Drop what we have if it can't fit in the line buffer */
+	if(serio->discard || ((serio->tail - serio->head) >= (SERIO_MAX_LINE - 1))){
+		serio->discard = TRUE;
+		serio->head = serio->tail = 0;
+	}
+	return FALSE;
+}
+
+/*
+* Feed bytes of traffic through a splitter in chunks.
+* Returns the time taken in ns. The number of lines and a hash of their contents
+* are returned through lines and hash.
+*/
+
+static uint64_t run(Bool (*split)(serioStuffPtr_t, char, Bool), unsigned chunk, uint64_t bytes,
+unsigned *lines, uint32_t *hash)
+{
+	serioStuff_t serio;
+	uint64_t fed, t;
+	unsigned i, pos = 0, count = 0;
+	uint32_t h = 2166136261U;
+
+	memset(&serio, 0, sizeof(serio));
+	if(!(serio.rxbuf = malloc(SERIO_RX_SIZE))){
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	serio.line = lineBuf;
+
+	t = nowNs();
+	for(fed = 0; fed < bytes; ){
+		fed += fill(&serio, chunk, &pos);
+		while(split(&serio, '\r', FALSE) == TRUE){
+			count++;
+			for(i = 0; i < serio.len; i++) /* Stands in for the decoder reading the line */
+				h = (h ^ (unsigned char) serio.line[i]) * 16777619U;
+		}
+	}
+	t = nowNs() - t;
+
+	free(serio.rxbuf);
+	*lines = count;
+	*hash = h;
+	return t;
+}
+
+/*
+* Time both splitters at each chunk size and print the results
+*/
+
+int main(int argc, char *argv[])
+{
+	int a;
+	unsigned chunk, linesB, linesM;
+	uint32_t hashB, hashM;
+	uint64_t tB, tM;
+	static const char *defChunks[] = {"1", "16", "64", "512", "4096"};
+	const char **chunks = defChunks;
+	int numChunks = sizeof(defChunks) / sizeof(defChunks[0]);
+
+	if(argc < 2){
+		fprintf(stderr, "Usage: %s traffic-file [chunk-size ...]\n", argv[0]);
+		exit(1);
+	}
+	if(!loadTraffic(argv[1])){
+		fprintf(stderr, "Can't load traffic file %s\n", argv[1]);
+		exit(1);
+	}
+	if(argc > 2){
+		chunks = (const char **) &argv[2];
+		numChunks = argc - 2;
+	}
+
+	printf("%u bytes of traffic, %d MB through each splitter\n", trafficLen, BENCH_BYTES / (1024 * 1024));
+	for(a = 0; a < numChunks; a++){
+		chunk = (unsigned) atoi(chunks[a]);
+		if((!chunk) || (chunk > SERIO_RX_SIZE)){
+			fprintf(stderr, "Chunk size must be between 1 and %d\n", SERIO_RX_SIZE);
+			exit(1);
+		}
+		tB = run(lineBytes, chunk, BENCH_BYTES, &linesB, &hashB);
+		tM = run(serio_rx_line, chunk, BENCH_BYTES, &linesM, &hashM);
+		if((linesB != linesM) || (hashB != hashM)){
+			fprintf(stderr, "Splitters disagree at chunk size %u\n", chunk);
+			exit(1);
+		}
+		printf("chunk %4u  bytes %7.1f MB/s %6.1f ns/line   memchr %7.1f MB/s %6.1f ns/line\n", chunk,
+		(BENCH_BYTES / 1e6) / (tB / 1e9), (double) tB / linesB,
+		(BENCH_BYTES / 1e6) / (tM / 1e9), (double) tM / linesM);
+	}
+	return 0;
+}
@@ -138,7 +138,7 @@ void debug(int level, char *message, ...) {
 	/* We only do this code if we are at or above the debug level. */
 	if(debugLvl >= level) {
 		t = time(NULL);
-		strncpy(timenow,ctime(&t), 31);
+		ctime_r(&t, timenow); /* Reentrant, debug can be called from the bus threads */
 		timenow[31] = 0;
 		l = strlen(timenow);
 		if(l)
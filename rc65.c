@@ -0,0 +1,653 @@
+/*
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+* rc65.c
+*
+* Decodes RC-65 status and response lines into a fixed layout structure,
+* compares two decoded lines field by field, and translates field values
+* to and from xPL and basic commands. Everything field specific is generated
+* from the protocol table in rc65.h.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "types.h"
+#include "rc65.h"
+
+/* Status keys, command keys, xPL names and kinds, indexed by field */
+
+#define RC65_FIELD_KEY(id, k1, k2, k3, cmd, kind, member, xpl) #id,
+static const char *const statusKeys[RC65_FIELDS] = { RC65_FIELD_TABLE(RC65_FIELD_KEY) };
+#undef RC65_FIELD_KEY
+
+#define RC65_FIELD_CMD(id, k1, k2, k3, cmd, kind, member, xpl) cmd,
+static const char *const commandKeys[RC65_FIELDS] = { RC65_FIELD_TABLE(RC65_FIELD_CMD) };
+#undef RC65_FIELD_CMD
+
+#define RC65_FIELD_XPL(id, k1, k2, k3, cmd, kind, member, xpl) xpl,
+static const String xplNames[RC65_FIELDS] = { RC65_FIELD_TABLE(RC65_FIELD_XPL) };
+#undef RC65_FIELD_XPL
+
+#define RC65_FIELD_KIND(id, k1, k2, k3, cmd, kind, member, xpl) RC65_KIND_##kind,
+static const rc65Kind_t fieldKinds[RC65_FIELDS] = { RC65_FIELD_TABLE(RC65_FIELD_KIND) };
+#undef RC65_FIELD_KIND
+
+/* xPL names for modes, fan modes and system states */
+
+#define RC65_VALUE_XPL(id, code, xpl) xpl,
+const String rc65_mode_names[] = { RC65_MODE_TABLE(RC65_VALUE_XPL) NULL };
+const String rc65_fan_names[] = { RC65_FAN_TABLE(RC65_VALUE_XPL) NULL };
+const String rc65_state_names[] = { RC65_STATE_TABLE(RC65_VALUE_XPL) NULL };
+#undef RC65_VALUE_XPL
+
+/* Bus value characters for modes, fan modes and system states */
+
+#define RC65_VALUE_CODE(id, code, xpl) code,
+static const char modeCodes[] = { RC65_MODE_TABLE(RC65_VALUE_CODE) };
+static const char fanCodes[] = { RC65_FAN_TABLE(RC65_VALUE_CODE) };
+static const char stateCodes[] = { RC65_STATE_TABLE(RC65_VALUE_CODE) };
+#undef RC65_VALUE_CODE
+
+
+/*
+* Value translators, one set per kind.
+*
+* decode_<kind>() translates a value from a status line.
+* format_<kind>() translates a decoded value to xPL.
+* parse_<kind>() translates an xPL value, returning FALSE if it is invalid.
+* encode_<kind>() translates a value to a basic command.
+* moved_<kind>() tells if a value moved far enough from the last one to be reported.
+*/
+
+/*
+* Decode a temperature into tenths of a degree. Accepts an optional sign and one decimal place.
+*/
+
+static rc65Temp_t decode_Temp(const char *p, const char *end)
+{
+	int neg = 0, v = 0, tenths = 0;
+
+	if((p < end) && ((*p == '-') || (*p == '+')))
+		neg = (*p++ == '-');
+	for(; (p < end) && (*p >= '0') && (*p <= '9'); p++)
+		v = (v * 10) + (*p - '0');
+	if((p < end) && (*p == '.') && (p + 1 < end) && (p[1] >= '0') && (p[1] <= '9'))
+		tenths = p[1] - '0';
+	v = (v * 10) + tenths;
+	return neg ? -v : v;
+}
+
+/*
+* Decode an unsigned number
+*/
+
+static rc65Uns_t decode_Uns(const char *p, const char *end)
+{
+	unsigned v = 0;
+
+	for(; (p < end) && (*p >= '0') && (*p <= '9'); p++)
+		v = (v * 10) + (*p - '0');
+	return v;
+}
+
+/*
+* Decode a mode
+*/
+
+static rc65Mode_t decode_Mode(const char *p, const char *end)
+{
+	#define RC65_MODE_CASE(id, code, xpl) case code: return RC65_MODE_##id;
+	switch(((p < end) && (end - p == 1)) ? *p : 0){
+		RC65_MODE_TABLE(RC65_MODE_CASE)
+		default:
+			return RC65_MODE_UNKNOWN;
+	}
+	#undef RC65_MODE_CASE
+}
+
+/*
+* Decode a fan mode
+*/
+
+static rc65Fan_t decode_Fan(const char *p, const char *end)
+{
+	#define RC65_FAN_CASE(id, code, xpl) case code: return RC65_FAN_##id;
+	switch(((p < end) && (end - p == 1)) ? *p : 0){
+		RC65_FAN_TABLE(RC65_FAN_CASE)
+		default:
+			return RC65_FAN_UNKNOWN;
+	}
+	#undef RC65_FAN_CASE
+}
+
+/*
+* Decode a system state
+*/
+
+static rc65State_t decode_State(const char *p, const char *end)
+{
+	#define RC65_STATE_CASE(id, code, xpl) case code: return RC65_STATE_##id;
+	switch(((p < end) && (end - p == 1)) ? *p : 0){
+		RC65_STATE_TABLE(RC65_STATE_CASE)
+		default:
+			return RC65_STATE_UNKNOWN;
+	}
+	#undef RC65_STATE_CASE
+}
+
+/*
+* Decode a flag
+*/
+
+static rc65Bool_t decode_Bool(const char *p, const char *end)
+{
+	return ((p < end) && (*p != '0')) ? TRUE : FALSE;
+}
+
+static char *format_Temp(char *buf, size_t size, int v)
+{
+	return rc65_format_temp(buf, size, v);
+}
+
+static char *format_Uns(char *buf, size_t size, int v)
+{
+	snprintf(buf, size, "%u", (unsigned) v);
+	return buf;
+}
+
+static char *format_Mode(char *buf, size_t size, int v)
+{
+	snprintf(buf, size, "%s", ((v >= 0) && (v < RC65_MODE_UNKNOWN)) ? rc65_mode_names[v] : "?");
+	return buf;
+}
+
+static char *format_Fan(char *buf, size_t size, int v)
+{
+	snprintf(buf, size, "%s", ((v >= 0) && (v < RC65_FAN_UNKNOWN)) ? rc65_fan_names[v] : "?");
+	return buf;
+}
+
+static char *format_State(char *buf, size_t size, int v)
+{
+	snprintf(buf, size, "%s", ((v >= 0) && (v < RC65_STATE_UNKNOWN)) ? rc65_state_names[v] : "?");
+	return buf;
+}
+
+static char *format_Bool(char *buf, size_t size, int v)
+{
+	snprintf(buf, size, "%s", v ? "on" : "off");
+	return buf;
+}
+
+/*
+* Parse a temperature. Must be a number with at most one decimal place.
+*/
+
+static Bool parse_Temp(const char *s, int *v)
+{
+	const char *p = s;
+
+	if((*p == '-') || (*p == '+'))
+		p++;
+	if((*p < '0') || (*p > '9'))
+		return FALSE;
+	while((*p >= '0') && (*p <= '9'))
+		p++;
+	if((*p == '.') && (p[1] >= '0') && (p[1] <= '9'))
+		p += 2;
+	if(*p)
+		return FALSE;
+	*v = decode_Temp(s, p);
+	return TRUE;
+}
+
+static Bool parse_Uns(const char *s, int *v)
+{
+	const char *p = s;
+
+	while((*p >= '0') && (*p <= '9'))
+		p++;
+	if((p == s) || (*p))
+		return FALSE;
+	*v = decode_Uns(s, p);
+	return TRUE;
+}
+
+static Bool parse_List(const String *list, const char *s, int *v)
+{
+	int i;
+
+	for(i = 0; list[i]; i++){
+		if(!strcmp(s, list[i])){
+			*v = i;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static Bool parse_Mode(const char *s, int *v)
+{
+	return parse_List(rc65_mode_names, s, v);
+}
+
+static Bool parse_Fan(const char *s, int *v)
+{
+	return parse_List(rc65_fan_names, s, v);
+}
+
+static Bool parse_State(const char *s, int *v)
+{
+	return parse_List(rc65_state_names, s, v);
+}
+
+/*
+* Parse a flag. Anything other than on, yes or 1 is off.
+*/
+
+static Bool parse_Bool(const char *s, int *v)
+{
+	*v = ((!strcmp(s, "on")) || (!strcmp(s, "yes")) || (!strcmp(s, "1")));
+	return TRUE;
+}
+
+static char *encode_Temp(char *buf, size_t size, int v)
+{
+	return rc65_format_temp(buf, size, v);
+}
+
+static char *encode_Uns(char *buf, size_t size, int v)
+{
+	return format_Uns(buf, size, v);
+}
+
+static char *encode_Mode(char *buf, size_t size, int v)
+{
+	if((v < 0) || (v >= RC65_MODE_UNKNOWN))
+		return NULL;
+	snprintf(buf, size, "%c", modeCodes[v]);
+	return buf;
+}
+
+static char *encode_Fan(char *buf, size_t size, int v)
+{
+	if((v < 0) || (v >= RC65_FAN_UNKNOWN))
+		return NULL;
+	snprintf(buf, size, "%c", fanCodes[v]);
+	return buf;
+}
+
+static char *encode_State(char *buf, size_t size, int v)
+{
+	if((v < 0) || (v >= RC65_STATE_UNKNOWN))
+		return NULL;
+	snprintf(buf, size, "%c", stateCodes[v]);
+	return buf;
+}
+
+static char *encode_Bool(char *buf, size_t size, int v)
+{
+	snprintf(buf, size, "%c", v ? '1' : '0');
+	return buf;
+}
+
+/*
+* Numeric values have to move by at least the deadband. Anything else reports every change.
+*/
+
+static Bool moved_Temp(int old, int new, int deadband)
+{
+	return (old != new) && (abs(new - old) >= deadband);
+}
+
+static Bool moved_Uns(unsigned old, unsigned new, int deadband)
+{
+	return (old != new) && (((old > new) ? old - new : new - old) >= (unsigned) deadband);
+}
+
+static Bool moved_Enum(int old, int new)
+{
+	return old != new;
+}
+
+#define moved_Mode(old, new, deadband) moved_Enum(old, new)
+#define moved_Fan(old, new, deadband) moved_Enum(old, new)
+#define moved_State(old, new, deadband) moved_Enum(old, new)
+#define moved_Bool(old, new, deadband) moved_Enum(old, new)
+
+/*
+* Decode a status or response line in one pass.
+* Keys are dispatched by a switch on the packed key characters.
+* Unknown keys are ignored. Returns the mask of fields present.
+*/
+
+unsigned rc65_decode(const char *line, rc65StatusPtr_t st)
+{
+	const char *p, *eq, *val, *end;
+	unsigned a = 0, key;
+
+	memset(st, 0, sizeof(rc65Status_t));
+	if(!line)
+		return 0;
+
+	for(p = line; *p; p = end){
+		while(*p == ' ')
+			p++;
+		if(!*p)
+			break;
+		end = p + strcspn(p, " ");
+		if(!(eq = memchr(p, '=', end - p)) || (eq == p) || (eq - p > 3))
+			continue;
+		val = eq + 1;
+
+		key = (unsigned char) p[0];
+		if(eq - p > 1)
+			key |= (unsigned) (unsigned char) p[1] << 8;
+		if(eq - p > 2)
+			key |= (unsigned) (unsigned char) p[2] << 16;
+
+		#define RC65_DECODE_CASE(id, k1, k2, k3, cmd, kind, member, xpl) \
+			case RC65_PACK(k1, k2, k3): \
+				st->member = decode_##kind(val, end); \
+				st->present |= RC65_BIT(RC65_##id); \
+				break;
+
+		switch(key){
+			RC65_FIELD_TABLE(RC65_DECODE_CASE)
+
+			case RC65_PACK('O', 0, 0):
+				st->address = decode_Uns(val, end);
+				break;
+
+			case RC65_PACK('A', 0, 0):
+				a = decode_Uns(val, end);
+				break;
+
+			default:
+				break;
+		}
+
+		#undef RC65_DECODE_CASE
+	}
+
+	/* Responses come from O=n and are addressed to A=0. Fall back to A=n if there is no O=n. */
+	if(!st->address)
+		st->address = a;
+
+	return st->present;
+}
+
+/*
+* Decode the fields a basic command sets, such as "A=1 M=C SPH=70", in the same layout
+* as a status line. Values which are not settable or are queries are ignored.
+* Returns the mask of fields set.
+*/
+
+unsigned rc65_decode_command(const char *line, rc65StatusPtr_t st)
+{
+	const char *p, *eq, *val, *end;
+	rc65Field_t f;
+
+	memset(st, 0, sizeof(rc65Status_t));
+	if(!line)
+		return 0;
+
+	for(p = line; *p; p = end){
+		while(*p == ' ')
+			p++;
+		if(!*p)
+			break;
+		end = p + strcspn(p, " ");
+		if(!(eq = memchr(p, '=', end - p)))
+			continue;
+		val = eq + 1;
+		if((eq - p == 1) && (*p == 'A')){
+			st->address = decode_Uns(val, end);
+			continue;
+		}
+		if(((f = rc65_command_field(p, eq - p)) == RC65_NONE) || (val == end) || (*val == '?'))
+			continue;
+
+		#define RC65_COMMAND_CASE(id, k1, k2, k3, cmd, kind, member, xpl) \
+			case RC65_##id: \
+				st->member = decode_##kind(val, end); \
+				break;
+		switch(f){
+			RC65_FIELD_TABLE(RC65_COMMAND_CASE)
+			default:
+				break;
+		}
+		#undef RC65_COMMAND_CASE
+		st->present |= RC65_BIT(f);
+	}
+	return st->present;
+}
+
+/*
+* Compare two decoded lines.
+* Returns the mask of fields which were added, removed, or changed value.
+*/
+
+unsigned rc65_diff(const rc65Status_t *old, const rc65Status_t *new)
+{
+	unsigned both = old->present & new->present;
+	unsigned changed = old->present ^ new->present;
+
+	#define RC65_DIFF_FIELD(id, k1, k2, k3, cmd, kind, member, xpl) \
+		if((both & RC65_BIT(RC65_##id)) && (old->member != new->member)) \
+			changed |= RC65_BIT(RC65_##id);
+	RC65_FIELD_TABLE(RC65_DIFF_FIELD)
+	#undef RC65_DIFF_FIELD
+
+	return changed;
+}
+
+/*
+* Compare a new line with the last one reported.
+* Like rc65_diff(), but numeric fields only count as changed if they moved by at least
+* their deadband. deadband is indexed by field, in the units of the decoded values.
+*/
+
+unsigned rc65_changed(const rc65Status_t *old, const rc65Status_t *new, const int *deadband)
+{
+	unsigned both = old->present & new->present;
+	unsigned changed = old->present ^ new->present;
+
+	#define RC65_CHANGED_FIELD(id, k1, k2, k3, cmd, kind, member, xpl) \
+		if((both & RC65_BIT(RC65_##id)) && (moved_##kind(old->member, new->member, deadband[RC65_##id]))) \
+			changed |= RC65_BIT(RC65_##id);
+	RC65_FIELD_TABLE(RC65_CHANGED_FIELD)
+	#undef RC65_CHANGED_FIELD
+
+	return changed;
+}
+
+/*
+* Copy the fields in mask from one line to another.
+* Fields in mask which are not present in src are removed from dst.
+*/
+
+void rc65_merge(rc65StatusPtr_t dst, const rc65Status_t *src, unsigned mask)
+{
+	#define RC65_MERGE_FIELD(id, k1, k2, k3, cmd, kind, member, xpl) \
+		if(mask & RC65_BIT(RC65_##id)) \
+			dst->member = src->member;
+	RC65_FIELD_TABLE(RC65_MERGE_FIELD)
+	#undef RC65_MERGE_FIELD
+
+	dst->present = (dst->present & ~mask) | (src->present & mask);
+	dst->address = src->address;
+}
+
+/*
+* Format a temperature in tenths of a degree. Whole degrees are printed without a decimal point.
+*/
+
+char *rc65_format_temp(char *buf, size_t size, int tenths)
+{
+	unsigned mag = (tenths < 0) ? -tenths : tenths;
+
+	if(mag % 10)
+		snprintf(buf, size, "%s%u.%u", (tenths < 0) ? "-" : "", mag / 10, mag % 10);
+	else
+		snprintf(buf, size, "%d", tenths / 10);
+	return buf;
+}
+
+/*
+* Format a decoded field as an xPL value. 
+* Returns NULL if the field is not present.
+*/
+
+char *rc65_format(char *buf, size_t size, const rc65Status_t *st, rc65Field_t f)
+{
+	if((f >= RC65_FIELDS) || !(st->present & RC65_BIT(f)))
+		return NULL;
+
+	#define RC65_FORMAT_CASE(id, k1, k2, k3, cmd, kind, member, xpl) \
+		case RC65_##id: \
+			return format_##kind(buf, size, st->member);
+	switch(f){
+		RC65_FIELD_TABLE(RC65_FORMAT_CASE)
+		default:
+			return NULL;
+	}
+	#undef RC65_FORMAT_CASE
+}
+
+/*
+* Parse an xPL value for a field.
+* Returns FALSE if the value is not valid for the field.
+*/
+
+Bool rc65_parse(rc65Field_t f, const char *s, int *value)
+{
+	if(!s || !value)
+		return FALSE;
+
+	#define RC65_PARSE_CASE(id, k1, k2, k3, cmd, kind, member, xpl) \
+		case RC65_##id: \
+			return parse_##kind(s, value);
+	switch(f){
+		RC65_FIELD_TABLE(RC65_PARSE_CASE)
+		default:
+			return FALSE;
+	}
+	#undef RC65_PARSE_CASE
+}
+
+/*
+* Append " KEY=VALUE" to a basic command.
+* Returns NULL if the field can't be set, or the result would not fit.
+*/
+
+char *rc65_encode(char *buf, size_t size, rc65Field_t f, int value)
+{
+	char wc[16];
+	const char *v = NULL;
+	size_t len = strlen(buf);
+
+	if((f >= RC65_FIELDS) || (!commandKeys[f]))
+		return NULL;
+
+	#define RC65_ENCODE_CASE(id, k1, k2, k3, cmd, kind, member, xpl) \
+		case RC65_##id: \
+			v = encode_##kind(wc, sizeof(wc), value); \
+			break;
+	switch(f){
+		RC65_FIELD_TABLE(RC65_ENCODE_CASE)
+		default:
+			break;
+	}
+	#undef RC65_ENCODE_CASE
+
+	if((!v) || ((size_t) snprintf(buf + len, size - len, " %s=%s", commandKeys[f], v) >= size - len)){
+		buf[len] = 0;
+		return NULL;
+	}
+	return buf;
+}
+
+/*
+* Append " KEY=?" to a basic command to query a field.
+* Returns NULL if the field has no command key, or the result would not fit.
+*/
+
+char *rc65_encode_query(char *buf, size_t size, rc65Field_t f)
+{
+	size_t len = strlen(buf);
+
+	if((f >= RC65_FIELDS) || (!commandKeys[f]))
+		return NULL;
+
+	if((size_t) snprintf(buf + len, size - len, " %s=?", commandKeys[f]) >= size - len){
+		buf[len] = 0;
+		return NULL;
+	}
+	return buf;
+}
+
+/*
+* Return the field set by a command key, or RC65_NONE if the key is not settable.
+*/
+
+rc65Field_t rc65_command_field(const char *key, size_t len)
+{
+	int i;
+
+	for(i = 0; i < RC65_FIELDS; i++){
+		if((commandKeys[i]) && (strlen(commandKeys[i]) == len) && (!strncmp(key, commandKeys[i], len)))
+			return i;
+	}
+	return RC65_NONE;
+}
+
+/*
+* Return the xPL name for a field
+*/
+
+String rc65_xpl_name(rc65Field_t f)
+{
+	return (f < RC65_FIELDS) ? xplNames[f] : NULL;
+}
+
+/*
+* Return the field with a status key, or RC65_NONE if there is no such field
+*/
+
+rc65Field_t rc65_field(const char *key)
+{
+	int i;
+
+	for(i = 0; i < RC65_FIELDS; i++){
+		if(!strcasecmp(key, statusKeys[i]))
+			return i;
+	}
+	return RC65_NONE;
+}
+
+/*
+* Return the kind of value a field holds
+*/
+
+rc65Kind_t rc65_kind(rc65Field_t f)
+{
+	return fieldKinds[(f < RC65_FIELDS) ? f : 0];
+}
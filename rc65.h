@@ -0,0 +1,169 @@
+/*
+*    RC-65 status decoder
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    RC-65 protocol table and status definitions.
+*
+*
+*/
+
+#ifndef RC65DEFS_H
+#define RC65DEFS_H
+
+#include <stddef.h>
+#include "types.h"
+
+/*
+* RC-65 protocol table.
+*
+* Each row describes one field:
+*
+* X(id, k1, k2, k3, cmd, kind, member, xpl)
+*
+* id	   Field name, also the key in status lines (RC65_<id> is the field number)
+* k1-k3	   Key characters, zero padded. Packed by RC65_PACK() to dispatch status keys.
+* cmd	   Key used to set the field in a basic command, NULL if read only
+* kind	   Value kind, one of Temp, Uns, Mode, Fan, State or Bool. Selects the value translators.
+* member   Member of struct rc65status holding the decoded value
+* xpl	   xPL name for the field
+*
+* The field enum, the status structure, the decoder, the comparer, the
+* formatters and the command encoder are all generated from this table.
+* To add a field, add a row here.
+*/
+
+#define RC65_FIELD_TABLE(X) \
+	X(T,   'T', 0,   0,   NULL,  Temp, temp,         "temperature") \
+	X(SP,  'S', 'P', 0,   NULL,  Temp, setpoint,     "current-setpoint") \
+	X(SPH, 'S', 'P', 'H', "SPH", Temp, heatSetpoint, "heating") \
+	X(SPC, 'S', 'P', 'C', "SPC", Temp, coolSetpoint, "cooling") \
+	X(M,   'M', 0,   0,   "M",   Mode, mode,         "hvac-mode") \
+	X(FM,  'F', 'M', 0,   "F",   Fan,  fan,          "fan-mode") \
+	X(RTH, 'R', 'T', 'H', "RTH", Uns,  heatTime,     "heating") \
+	X(RTC, 'R', 'T', 'C', "RTC", Uns,  coolTime,     "cooling") \
+	X(RTF, 'R', 'T', 'F', "RTF", Uns,  fanTime,      "running") \
+	X(OT,  'O', 'T', 0,   "OT",  Temp, outsideTemp,  "outsidetemp") \
+	X(DL,  'D', 'L', 0,   "DL",  Bool, lock,         "lock") \
+	X(Z,   'Z', 0,   0,   NULL,  Uns,  zoneNumber,   "rcs-zone") \
+	X(SM,  'S', 'M', 0,   NULL,  State, state,       "hvac-state") \
+	X(SF,  'S', 'F', 0,   NULL,  Bool, fanState,     "fan-state") \
+	X(H1A, 'H', '1', 'A', NULL,  Bool, heatStage1,   "heat-stage-1") \
+	X(H2A, 'H', '2', 'A', NULL,  Bool, heatStage2,   "heat-stage-2") \
+	X(H3A, 'H', '3', 'A', NULL,  Bool, heatStage3,   "heat-stage-3") \
+	X(C1A, 'C', '1', 'A', NULL,  Bool, coolStage1,   "cool-stage-1") \
+	X(C2A, 'C', '2', 'A', NULL,  Bool, coolStage2,   "cool-stage-2") \
+	X(H,   'H', 0,   0,   NULL,  Bool, hold,         "hold") \
+	X(V,   'V', 0,   0,   NULL,  Bool, vacation,     "vacation")
+
+/*
+* Mode, fan mode and system state value tables.
+*
+* X(id, code, xpl)
+*
+* code is the value character on the bus, xpl is the xPL name.
+*/
+
+#define RC65_MODE_TABLE(X) \
+	X(OFF,  'O', "off") \
+	X(HEAT, 'H', "heat") \
+	X(COOL, 'C', "cool") \
+	X(AUTO, 'A', "auto")
+
+#define RC65_FAN_TABLE(X) \
+	X(AUTO, '0', "auto") \
+	X(ON,   '1', "on")
+
+#define RC65_STATE_TABLE(X) \
+	X(OFF,  'O', "off") \
+	X(HEAT, 'H', "heating") \
+	X(COOL, 'C', "cooling")
+
+/* Pack up to three key characters into an integer, usable as a case label */
+#define RC65_PACK(k1, k2, k3)	((unsigned) (k1) | ((unsigned) (k2) << 8) | ((unsigned) (k3) << 16))
+
+#define RC65_BIT(f)	(1U << (f))
+#define RC65_ALL	(RC65_BIT(RC65_FIELDS) - 1)
+
+/* Status fields, one bit each in the present and changed masks */
+#define RC65_FIELD_ENUM(id, k1, k2, k3, cmd, kind, member, xpl) RC65_##id,
+typedef enum {RC65_FIELD_TABLE(RC65_FIELD_ENUM) RC65_FIELDS, RC65_NONE = RC65_FIELDS} rc65Field_t;
+#undef RC65_FIELD_ENUM
+
+/* Modes, in the same order as rc65_mode_names */
+#define RC65_MODE_ENUM(id, code, xpl) RC65_MODE_##id,
+typedef enum {RC65_MODE_TABLE(RC65_MODE_ENUM) RC65_MODE_UNKNOWN} rc65Mode_t;
+#undef RC65_MODE_ENUM
+
+/* Fan modes, in the same order as rc65_fan_names */
+#define RC65_FAN_ENUM(id, code, xpl) RC65_FAN_##id,
+typedef enum {RC65_FAN_TABLE(RC65_FAN_ENUM) RC65_FAN_UNKNOWN} rc65Fan_t;
+#undef RC65_FAN_ENUM
+
+/* System states */
+#define RC65_STATE_ENUM(id, code, xpl) RC65_STATE_##id,
+typedef enum {RC65_STATE_TABLE(RC65_STATE_ENUM) RC65_STATE_UNKNOWN} rc65State_t;
+#undef RC65_STATE_ENUM
+
+/* Value kinds */
+typedef enum {RC65_KIND_Temp, RC65_KIND_Uns, RC65_KIND_Mode, RC65_KIND_Fan, RC65_KIND_State, RC65_KIND_Bool} rc65Kind_t;
+
+/* Value types for each kind */
+typedef int rc65Temp_t;		/* Fixed point, tenths of a degree */
+typedef unsigned rc65Uns_t;
+typedef Bool rc65Bool_t;
+
+/* Typedefs. */
+typedef struct rc65status rc65Status_t;
+typedef rc65Status_t * rc65StatusPtr_t;
+
+/*
+* Decoded status line.
+* A field is only valid if its bit is set in present.
+*/
+
+#define RC65_FIELD_MEMBER(id, k1, k2, k3, cmd, kind, member, xpl) rc65##kind##_t member;
+
+struct rc65status {
+	unsigned present;	/* Bit mask of fields present */
+	unsigned address;	/* Thermostat address, 0 if none */
+	RC65_FIELD_TABLE(RC65_FIELD_MEMBER)
+};
+
+#undef RC65_FIELD_MEMBER
+
+/* xPL names for modes, fan modes and system states, NULL terminated */
+extern const String rc65_mode_names[];
+extern const String rc65_fan_names[];
+extern const String rc65_state_names[];
+
+/* Prototypes. */
+unsigned rc65_decode(const char *line, rc65StatusPtr_t st);
+unsigned rc65_decode_command(const char *line, rc65StatusPtr_t st);
+unsigned rc65_diff(const rc65Status_t *old, const rc65Status_t *new);
+unsigned rc65_changed(const rc65Status_t *old, const rc65Status_t *new, const int *deadband);
+void rc65_merge(rc65StatusPtr_t dst, const rc65Status_t *src, unsigned mask);
+char *rc65_format_temp(char *buf, size_t size, int tenths);
+char *rc65_format(char *buf, size_t size, const rc65Status_t *st, rc65Field_t f);
+Bool rc65_parse(rc65Field_t f, const char *s, int *value);
+char *rc65_encode(char *buf, size_t size, rc65Field_t f, int value);
+char *rc65_encode_query(char *buf, size_t size, rc65Field_t f);
+rc65Field_t rc65_command_field(const char *key, size_t len);
+String rc65_xpl_name(rc65Field_t f);
+rc65Field_t rc65_field(const char *key);
+rc65Kind_t rc65_kind(rc65Field_t f);
+
+#endif
@@ -27,6 +27,7 @@
 #include "types.h"
 
 #define SERIO_MAX_LINE 1024
+#define SERIO_RX_SIZE 4096
 
 
 /* Typedefs. */
@@ -36,12 +37,17 @@ typedef serioStuff_t * serioStuffPtr_t;
 /* Structure to hold serio info. */
 struct seriostuff {
 	Bool eof;			/* EOF flag */
+	Bool discard;		/* Discarding an overlong line up to the next delimiter */
 	int fd;				/* File descriptor */
-	int pos;			/* Position variable for non-blocking read fn's */
+	unsigned head;		/* Index of the first unconsumed byte in the receive buffer */
+	unsigned tail;		/* Index one past the last valid byte in the receive buffer */
+	unsigned scan;		/* Index where the next delimiter search resumes */
+	unsigned len;		/* Length of the current line */
 	unsigned brc;		/* baud rate constant */
 	unsigned magic;	/* magic number */
 	char *path;			/* path name to node file */
-	char *line;			/* line buffer for non-blocking read fn's */
+	char *line;			/* current line in the receive buffer for non-blocking read fn's */
+	char *rxbuf;		/* receive buffer for non-blocking read fn's */
 };
 
 /* Prototypes. */
@@ -56,6 +62,8 @@ int serio_read(serioStuffPtr_t serio, void *buffer, size_t count);
 int serio_nb_line_read(serioStuffPtr_t serio);
 int serio_nb_line_readcr(serioStuffPtr_t serio);
 char *serio_line(serioStuffPtr_t serio);
+char *serio_line_view(serioStuffPtr_t serio, unsigned *len);
+Bool serio_rx_line(serioStuffPtr_t serio, char delim, Bool strip_cr);
 Bool serio_ateof(serioStuffPtr_t serio);
 int serio_printf(serioStuffPtr_t serio, const char *format, ...);
 
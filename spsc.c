@@ -0,0 +1,113 @@
+/*
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+* spsc.c
+*
+* Bounded lock-free single producer, single consumer ring. 
+* Used to pass fixed size elements between two threads without locks.
+*
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "types.h"
+#include "spsc.h"
+
+/*
+* Create a ring with room for at least the number of elements specified.
+* The slot count is rounded up to a power of 2.
+*/
+
+spscRingPtr_t spsc_create(unsigned slots, size_t elsize)
+{
+	spscRingPtr_t ring;
+	unsigned n;
+
+	if(!slots || !elsize)
+		return NULL;
+
+	for(n = 1; n < slots; n <<= 1);
+
+	/* Allocate memory for our struct */
+	if(!(ring = malloc(sizeof(spscRing_t))))
+		return NULL;
+
+	/* Zero it */
+	memset(ring, 0, sizeof(spscRing_t));
+
+	/* Allocate the element storage */
+	if(!(ring->slots = malloc(n * elsize))){
+		free(ring);
+		return NULL;
+	}
+
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	ring->mask = n - 1;
+	ring->elsize = elsize;
+	return ring;
+}
+
+/*
+* Copy an element into the ring. Producer side only.
+* Returns FALSE if the ring is full.
+*/
+
+Bool spsc_push(spscRingPtr_t ring, const void *el)
+{
+	unsigned head, tail;
+
+	if(!ring || !el)
+		return FALSE;
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if((head - tail) > ring->mask) /* Full */
+		return FALSE;
+
+	memcpy(ring->slots + ((head & ring->mask) * ring->elsize), el, ring->elsize);
+
+	/* Publish the element to the consumer */
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return TRUE;
+}
+
+/*
+* Copy the oldest element out of the ring. Consumer side only.
+* Returns FALSE if the ring is empty.
+*/
+
+Bool spsc_pop(spscRingPtr_t ring, void *el)
+{
+	unsigned head, tail;
+
+	if(!ring || !el)
+		return FALSE;
+
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	if(head == tail) /* Empty */
+		return FALSE;
+
+	memcpy(el, ring->slots + ((tail & ring->mask) * ring->elsize), ring->elsize);
+
+	/* Hand the slot back to the producer */
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return TRUE;
+}
@@ -0,0 +1,53 @@
+/*
+*    Single producer, single consumer ring functions
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Bounded lock-free ring definitions.
+*
+*
+*/
+
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include "types.h"
+
+/* Typedefs. */
+typedef struct spscring spscRing_t;
+typedef spscRing_t * spscRingPtr_t;
+
+/* 
+* Structure to hold a ring. 
+* Exactly one thread may push, and exactly one thread may pop.
+*/
+
+struct spscring {
+	atomic_uint head;	/* Next slot to be written, only stored by the producer */
+	atomic_uint tail;	/* Next slot to be read, only stored by the consumer */
+	unsigned mask;		/* Number of slots - 1 */
+	size_t elsize;		/* Size of one element */
+	char *slots;		/* Element storage */
+};
+
+/* Prototypes. */
+spscRingPtr_t spsc_create(unsigned slots, size_t elsize);
+Bool spsc_push(spscRingPtr_t ring, const void *el);
+Bool spsc_pop(spscRingPtr_t ring, void *el);
+
+#endif
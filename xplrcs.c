@@ -37,23 +37,67 @@
 #include <getopt.h>
 #include <limits.h>
 #include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <xPL.h>
 #include "types.h"
 #include "serio.h"
 #include "notify.h"
 #include "confread.h"
+#include "spsc.h"
+#include "rc65.h"
+#include "zone.h"
+#ifdef ALLOCSTAT
+#include "allocstat.h"
+#endif
 
 #define MALLOC_ERROR	malloc_error(__FILE__,__LINE__)
 
 #define SHORT_OPTIONS "c:d:f:hi:l:np:r:s:v"
 
 #define WS_SIZE 256
-#define MAX_ZONES 10
+#define BUS_ADDRESSES 256
 #define	POLL_RATE_MIN 2
 #define	POLL_RATE_MAX 180
+#define POLL_INTERVAL_MAX_DEF 60
+#define POLL_INTERVAL_MAX 3600
+#define POLL_BUDGET_DEF 25
+#define DEAD_AFTER_DEF 3
+#define PROBE_INTERVAL_DEF 10
+#define PROBE_INTERVAL_MAX_DEF 600
+#define PROBE_INTERVAL_MAX 86400
 #define SERIAL_RETRY_TIME 5
+#define RESPONSE_TIMEOUT_DEF 200
+#define RESPONSE_TIMEOUT_MIN 20
+#define RESPONSE_TIMEOUT_MAX 10000
+#define TIMEOUT_RETRIES_DEF 1
+#define TIMEOUT_RETRIES_MAX 10
+#define INTER_FRAME_GAP_DEF 100
+#define INTER_FRAME_GAP_MAX 5000
+#define MAX_FRAME_DEF 80
+#define MAX_FRAME_MIN 16
+#define QUEUE_AGING_DEF 2000
+#define QUEUE_AGING_MIN 100
+#define QUEUE_AGING_MAX 60000
+#define CMD_RING_SIZE 64
+#define QUEUE_SIZE_DEF 64
+#define QUEUE_SIZE_MIN 8
+#define QUEUE_SIZE_MAX 4096
+#define QUEUE_DEPTH_DEF 32
+#define ZONE_QUEUE_DEPTH_DEF 8
+#define EVENT_RING_SIZE 64
+#define MIN_EMIT_INTERVAL_MAX 86400
+#define COALESCE_WINDOW_MAX 10000
+#define MAX_STALENESS_DEF 5
+#define MAX_STALENESS_MAX 3600
+
+#define BUS_SECTION_PREFIX	"bus:"
+#define FIELD_SECTION_PREFIX	"field:"
 
 #define DEF_COM_PORT		"/dev/ttyS0"
 #define DEF_PID_FILE		"/var/run/xplrcs.pid"
@@ -66,7 +110,35 @@
 */
 
 typedef enum {CMDTYPE_NONE=0, CMDTYPE_BASIC, CMDTYPE_RQ_SETPOINT_HEAT, CMDTYPE_RQ_SETPOINT_COOL, 
-CMDTYPE_RQ_ZONE, CMDTYPE_DATETIME, CMDTYPE_RQ_HEATTIME, CMDTYPE_RQ_COOLTIME, CMDTYPE_RQ_FANTIME} CmdType_t;
+CMDTYPE_RQ_ZONE, CMDTYPE_DATETIME, CMDTYPE_RQ_HEATTIME, CMDTYPE_RQ_COOLTIME, CMDTYPE_RQ_FANTIME, 
+CMDTYPE_COUNT} CmdType_t;
+
+/*
+* Bus event types
+*/
+
+typedef enum {BUSEVENT_NONE=0, BUSEVENT_POLL, BUSEVENT_RESPONSE, BUSEVENT_TIMEOUT, BUSEVENT_OFFLINE, 
+BUSEVENT_ONLINE, BUSEVENT_FAILED, BUSEVENT_SENT, BUSEVENT_VERIFIED, BUSEVENT_BUSY} BusEventType_t;
+
+/*
+* Bus transaction states
+*/
+
+typedef enum {BUSSTATE_IDLE=0, BUSSTATE_WAIT, BUSSTATE_GAP} BusState_t;
+
+/*
+* What to do when a response does not arrive in time
+*/
+
+typedef enum {TIMEOUT_SKIP=0, TIMEOUT_RETRY, TIMEOUT_TRIGGER} TimeoutAction_t;
+
+/*
+* Scheduling classes, highest priority first.
+* Polls are not queued, they are due every poll period.
+*/
+
+typedef enum {CMDCLASS_INTERACTIVE=0, CMDCLASS_REQUEST, CMDCLASS_POLL, CMDCLASS_HOUSEKEEPING, 
+CMDCLASS_COUNT} CmdClass_t;
 
 
 /*
@@ -76,32 +148,207 @@ CMDTYPE_RQ_ZONE, CMDTYPE_DATETIME, CMDTYPE_RQ_HEATTIME, CMDTYPE_RQ_COOLTIME, CMD
 typedef struct zone_entry ZoneEntry_t;
 typedef ZoneEntry_t * ZoneEntryPtr_t;
 
- 
+typedef struct bus_entry BusEntry_t;
+typedef BusEntry_t * BusEntryPtr_t;
+
+typedef struct cmd_entry CmdEntry_t;
+typedef CmdEntry_t * CmdEntryPtr_t;
+
+/*
+* The members of a zone entry are grouped by who uses them: configuration which does not
+* change once the zones are set up, state owned by xPL, and state owned by the bus.
+* The poll state is in the bus owned sched and state arrays.
+*/
+
 struct zone_entry {
 	String name;
+	uint32_t hash; /* Hash of the name, for the zone table */
 	unsigned address;
-	Bool first_time;
-	String last_poll;
-	ZoneEntryPtr_t prev;
-	ZoneEntryPtr_t next;
+	unsigned queueDepth; /* Most commands which may wait for the zone */
+	BusEntryPtr_t bus;
+	ZoneSchedPtr_t sched;
+	ZoneStatePtr_t state;
+	rc65Status_t cache; /* Last status polled or requested, owned by xPL */
+	uint64_t cacheTime;
+	rc65Status_t trigStatus; /* Changes waiting for a combined trigger, owned by xPL */
+	unsigned trigChanged;
+	uint64_t trigDue;
+	unsigned depth; /* Commands waiting for the zone, owned by the bus as is everything below */
+	atomic_uint depthMax; /* High water mark of depth */
+	CmdEntryPtr_t pending[RC65_FIELDS]; /* Unsent basic command for each field */
+	CmdEntryPtr_t query[CMDTYPE_COUNT]; /* Queued or outstanding request of each type */
 }; 
 
 /*
 * Command queueing structure
+* Entries come from a fixed pool on each bus, and hold the command text inline.
 */
 
-typedef struct cmd_entry CmdEntry_t;
-typedef CmdEntry_t * CmdEntryPtr_t;
-
 struct cmd_entry {
-	String cmd;
+	char cmd[WS_SIZE];
 	CmdType_t type;
-	Bool sent;
+	rc65Field_t field;
+	uint64_t queued;
 	ZoneEntryPtr_t ze;
 	CmdEntryPtr_t prev;
 	CmdEntryPtr_t next;
 };
 
+/*
+* Command submission structure
+* Carries a command from the xPL side to a bus.
+*/
+
+typedef struct bus_cmd BusCmd_t;
+typedef BusCmd_t * BusCmdPtr_t;
+
+struct bus_cmd {
+	CmdType_t type;
+	uint64_t queued;
+	ZoneEntryPtr_t ze;
+	char cmd[WS_SIZE];
+};
+
+/*
+* Bus event structure
+* Carries a poll status change, or a response to a request from a bus to the xPL side.
+* For a poll status change, changed holds the mask of fields which changed.
+*/
+
+typedef struct bus_event BusEvent_t;
+typedef BusEvent_t * BusEventPtr_t;
+
+struct bus_event {
+	BusEventType_t type;
+	CmdType_t cmdType;
+	ZoneEntryPtr_t ze;
+	unsigned changed;
+	unsigned checked; /* Fields checked by a verification poll */
+	rc65Status_t status;
+};
+
+/*
+* Transaction table entry.
+* Holds the poll or command waiting for a response from one bus address.
+*/
+
+typedef struct bus_trans BusTrans_t;
+typedef BusTrans_t * BusTransPtr_t;
+
+struct bus_trans {
+	ZoneEntryPtr_t poll;
+	CmdEntryPtr_t cmd;
+};
+
+/*
+* Command queue, one per scheduling class
+*/
+
+typedef struct cmd_queue CmdQueue_t;
+typedef CmdQueue_t * CmdQueuePtr_t;
+
+struct cmd_queue {
+	CmdEntryPtr_t head;
+	CmdEntryPtr_t tail;
+};
+
+/*
+* Latency counters, one set per scheduling class.
+* Latency is the time from queueing (or from when a poll is due) to sending on the bus.
+* Written by the bus, read by the xPL side.
+*/
+
+typedef struct class_stats ClassStats_t;
+typedef ClassStats_t * ClassStatsPtr_t;
+
+struct class_stats {
+	atomic_uint count;
+	atomic_uint maxMs;
+	atomic_ullong totalMs;
+};
+
+/*
+* Bus entry structure
+*
+* One of these exists for each RS-485 bus. Each bus has its own serial port, zones,
+* command queue and poll state so that a slow bus never holds up another one.
+*
+* Transactions on the bus are sequenced by the state, deadline and nextPoll members,
+* using timerfd to wake up when the deadline or the next poll is reached. nextPoll and
+* pollZone are planned by busPlanPolls() from the per zone poll times and the poll budget.
+* pollPending and cmdPending are the transaction in progress. Responses are matched to
+* their transaction through the trans table, using the address in the response.
+*
+* The zone entries for a bus are allocated as one block of numZones entries, in configuration
+* order. sched is the poll schedule and zoneState is the poll state, each with one entry for
+* each zone in the same order as the zone entries.
+*
+* In threaded mode, everything from state down to pollZone is owned by the bus thread.
+* Commands are passed in through cmdRing and events come back out through evRing.
+*/
+
+struct bus_entry {
+	String name;
+	String comPort;
+	int id;
+	int cmdfd;
+	int evfd;
+	int timerfd;
+	pthread_t thread;
+	spscRingPtr_t cmdRing;
+	spscRingPtr_t evRing;
+	unsigned pollRate;
+	unsigned gap;
+	unsigned numZones;
+	unsigned queueDepth; /* Most commands which may wait on the bus */
+	unsigned depth; /* Commands waiting on the bus */
+	atomic_uint depthMax; /* High water mark of depth */
+	BusState_t state;
+	Bool retry;
+	unsigned retryCount;
+	uint64_t deadline;
+	uint64_t nextPoll;
+	uint64_t pollStart;
+	uint64_t pollBudgetAt;
+	unsigned serialRetryTimer;
+	serioStuffPtr_t serio;
+	CmdEntryPtr_t cmdPending;
+	BusTrans_t trans[BUS_ADDRESSES]; /* Outstanding transactions by thermostat address */
+	CmdQueue_t cmdQueue[CMDCLASS_COUNT];
+	CmdEntryPtr_t cmdPool; /* Fixed pool of queueSize command entries */
+	CmdEntryPtr_t cmdFree; /* Free list of command entries in the pool */
+	ClassStats_t stats[CMDCLASS_COUNT];
+	atomic_uint coalesced;
+	atomic_uint superseded;
+	atomic_uint failed;
+	atomic_uint stray;
+	atomic_uint joined;
+	atomic_uint busy;
+	ZoneEntryPtr_t zones;
+	ZoneSchedPtr_t sched;
+	ZoneStatePtr_t zoneState;
+	ZoneEntryPtr_t pollPending;
+	ZoneEntryPtr_t pollZone;
+	BusEntryPtr_t next;
+};
+
+/*
+* Parsed hvac command message.
+* The listener parses each hvac.basic or hvac.request message into one of these on the stack,
+* and the handlers work from it instead of looking values up in the message.
+*/
+
+typedef struct hvac_msg HvacMsg_t;
+typedef HvacMsg_t * HvacMsgPtr_t;
+
+struct hvac_msg {
+	int command; /* Index into basicCommandList or requestCommandList, -1 if none */
+	ZoneEntryPtr_t ze; /* NULL if no zone or an unknown zone was given */
+	rc65Field_t field; /* Set point or run time named by the message, RC65_NONE if none */
+	unsigned valid; /* Fields with a value to set in value */
+	int value[RC65_FIELDS];
+};
+
 /*
  * Command line override bits
  */
@@ -120,17 +367,43 @@ char *progName;
 int debugLvl = 0; 
 
 static Bool noBackground = FALSE;
+static Bool threadedMode = FALSE;
 static unsigned pollRate = 5;
+static unsigned interFrameGap = INTER_FRAME_GAP_DEF;
+static unsigned pollBudget = POLL_BUDGET_DEF;
+static unsigned deadAfter = DEAD_AFTER_DEF;
+static unsigned probeMin = PROBE_INTERVAL_DEF * 1000;
+static unsigned probeMax = PROBE_INTERVAL_MAX_DEF * 1000;
+static unsigned pollTimeout = RESPONSE_TIMEOUT_DEF;
+static unsigned commandTimeout = RESPONSE_TIMEOUT_DEF;
+static unsigned timeoutRetries = TIMEOUT_RETRIES_DEF;
+static TimeoutAction_t timeoutAction = TIMEOUT_SKIP;
+static unsigned queueSize = QUEUE_SIZE_DEF;
+static unsigned queueDepth = QUEUE_DEPTH_DEF;
+static unsigned zoneQueueDepth = ZONE_QUEUE_DEPTH_DEF;
+static unsigned queueAging = QUEUE_AGING_DEF;
+static unsigned maxFrameLength = MAX_FRAME_DEF;
+static int fieldDeadband[RC65_FIELDS]; /* Minimum change to report, in decoded units */
+static unsigned fieldMinEmit[RC65_FIELDS]; /* Minimum time between reports in ms */
+static Bool combinedTriggers = FALSE;
+static unsigned coalesceWindow = 0;
+static unsigned pendingTriggers = 0;
+static int triggerTimerFd = -1;
+static unsigned maxStaleness = MAX_STALENESS_DEF * 1000;
+static unsigned cacheHits = 0;
+static unsigned cacheMisses = 0;
+static unsigned handledCommands = 0;
+#ifdef ALLOCSTAT
+static unsigned handledAllocs = 0;
+#endif
 static unsigned numZones = 0;
-static unsigned serialRetryTimer = 0;
+static unsigned zoneTableSize = 0;
+static ZoneEntryPtr_t *zoneTable = NULL;
+static unsigned numBuses = 0;
 static clOverride_t clOverride = {0,0,0,0,0,0};
-static CmdEntryPtr_t cmdEntryHead = NULL;
-static CmdEntryPtr_t cmdEntryTail = NULL;
-static ZoneEntryPtr_t zoneEntryHead = NULL;
-static ZoneEntryPtr_t zoneEntryTail = NULL;
-static ZoneEntryPtr_t pollPending = NULL;
+static BusEntryPtr_t busEntryHead = NULL;
+static BusEntryPtr_t busEntryTail = NULL;
 
-static serioStuffPtr_t serioStuff = NULL;
 static xPL_ServicePtr xplrcsService = NULL;
 static xPL_MessagePtr xplrcsStatusMessage = NULL;
 static xPL_MessagePtr xplrcsTriggerMessage = NULL;
@@ -187,45 +460,19 @@ static const String requestCommandList[] = {
 	"zone",
 	"runtime",
 	"fantime",
+	"gatestats",
 	NULL
 };
 
+/* Scheduling class names */
 
-/* Heating and cooling modes */
-
-static const String const modeList[] = {
-	"off",
-	"heat",
-	"cool",
-	"auto",
-	NULL
-};
-
-/* Commands for modes */
-
-static const String modeCommands[] = {
-	"M=O",
-	"M=H",
-	"M=C",
-	"M=A",
-	NULL
-};	
-
-/* Fan modes  */
-
-static const String fanModeList[] = {
-	"auto",
-	"on",
-	NULL
+static const String cmdClassList[CMDCLASS_COUNT] = {
+	"interactive",
+	"request",
+	"poll",
+	"housekeeping"
 };
 
-/* Commands for fan modes */
-
-static const String fanModeCommands[] = {
-	"F=0",
-	"F=1",
-	NULL
-};
 
 /* List of valid set points */
 
@@ -242,14 +489,6 @@ static const String fanStateList[] = {
 	NULL
 };
 
-/* Commands for setpoints */
-
-static const String setPointCommands[] = {
-	"SPH",
-	"SPC",
-	NULL
-};
-
 /* List of valid display keywords */
 
 static const String displayList[] = {
@@ -404,6 +643,17 @@ static int pid_write(char *filename, pid_t pid) {
 	return 0;
 }
 
+/*
+* Convert a yes/no style string to a Bool
+*/
+
+static Bool str2Bool(const String s)
+{
+	if(!s)
+		return FALSE;
+	return ((!strcmp(s, "yes")) || (!strcmp(s, "on")) || (!strcmp(s, "true")) || (!strcmp(s, "1"))) ? TRUE : FALSE;
+}
+
 /*
 * Change string to upper case
 * Warning: String must be nul terminated.
@@ -437,413 +687,1171 @@ static void shutdownHandler(int onSignal)
 	exit(0);
 }
 
+
+
 /*
-* Parse an RC65 status line into its constituant elements
+* Return the scheduling class for a command type
 */
 
-static int parseRC65Status(String ws, String *list, int limit)
+static CmdClass_t cmdClass(CmdType_t type)
 {
-	int i;
-	String strtokrArgSave, arg, argList;
-	const String argDelim = " ";
-
-	/* Bail if pointers are NULL or work string has zero length */
-	if(!ws  || !list || !strlen(ws))
-		return 0;
-
-	for(argList = ws, i = 0; (i < limit) && (arg = strtok_r(argList, argDelim, &strtokrArgSave)); argList = NULL){
-		debug(DEBUG_ACTION,"Arg: %s", arg);
-		list[i++] = arg;
+	switch(type){
+		case CMDTYPE_BASIC:
+			return CMDCLASS_INTERACTIVE;
+
+		case CMDTYPE_RQ_SETPOINT_HEAT:
+		case CMDTYPE_RQ_SETPOINT_COOL:
+		case CMDTYPE_RQ_ZONE:
+		case CMDTYPE_RQ_HEATTIME:
+		case CMDTYPE_RQ_COOLTIME:
+		case CMDTYPE_RQ_FANTIME:
+			return CMDCLASS_REQUEST;
+
+		default:
+			return CMDCLASS_HOUSEKEEPING;
 	}
-	list[i] = NULL; /* Terminate end of list */
-	return i;
 }
 
 /*
-* Iterate through an arg list and return a val on a key match or else return NULL
+* Forward declaration, busEmit() hands bus events to the xPL side
 */
 
-static String getVal(String ws, int wslimit, String *argList, String key)
-{
-	int i;
-	String res = NULL;
-	String v;
+static void busEmit(BusEntryPtr_t bus, BusEventPtr_t ev);
 
-	for(i = 0; argList[i]; i++){
-		confreadStringCopy(ws, argList[i], wslimit); /* Make a local copy we can modify */
+/*
+* Fail a command for a zone which is offline, without sending it
+*/
 
-		if(!(v = strchr(ws, '='))) /* If there is no =, then bail */
-			break;
-		*v++ = 0;
-		if(!strncmp(ws, key, wslimit)){ /* if there is a match, set res to value and bail */
-			res = v;
-			break;
-		}
-	}
+static void busFailCommand(BusEntryPtr_t bus, ZoneEntryPtr_t ze, const String cmd, CmdType_t type)
+{
+	BusEvent_t ev;
 
-	return res;
+	debug(DEBUG_UNEXPECTED, "Zone %s is offline, command dropped: %s", ze->name, cmd);
+	atomic_fetch_add_explicit(&bus->failed, 1, memory_order_relaxed);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = BUSEVENT_FAILED;
+	ev.cmdType = type;
+	ev.ze = ze;
+	busEmit(bus, &ev);
 }
 
+/*
+* Return the field set by a single field basic command such as "A=1 SPH=70",
+* or RC65_NONE if it is something else.
+*/
+
+static rc65Field_t cmdField(const String cmd)
+{
+	const char *f, *eq;
+
+	if(!(f = strchr(cmd, ' ')) || strchr(++f, ' ') || !(eq = strchr(f, '=')))
+		return RC65_NONE;
 
+	return rc65_command_field(f, eq - f);
+}
 
 /*
-* Queue a command entry
+* Unlink a command entry from anywhere in a queue
 */
 
-static void queueCommand(ZoneEntryPtr_t ze, String cmd, CmdType_t type )
+static CmdEntryPtr_t unlinkCommand(BusEntryPtr_t bus, CmdQueuePtr_t q, CmdEntryPtr_t entry)
 {
-	CmdEntryPtr_t newCE = mallocz(sizeof(CmdEntry_t));
-	
-	/* Did malloc succeed ? */
-	if(!newCE)
-		MALLOC_ERROR;
-	
-	/* Dup the command string */
-	newCE->cmd = strdup(cmd);
+	if(!entry)
+		return NULL;
 
-	if(!newCE->cmd) /* Did strdup succeed? */
-		MALLOC_ERROR;
-		
-	/* Save the optional zone entry in the queued command */
-	newCE->ze = ze;
+	/* Once it leaves the queue, a command can no longer be superseded */
+	if((entry->field != RC65_NONE) && (entry->ze->pending[entry->field] == entry))
+		entry->ze->pending[entry->field] = NULL;
 
-	/* Save the type */
-	newCE->type = type;
+	bus->depth--;
+	if(entry->ze)
+		entry->ze->depth--;
 
-	if(!cmdEntryHead){ /* Empty list */
-		cmdEntryHead = cmdEntryTail =  newCE;
-	}
-	else{ /* List not empty */
-		cmdEntryTail->next = newCE;
-		newCE->prev = cmdEntryTail;
-		cmdEntryTail = newCE;
-	}
+	if(entry->prev)
+		entry->prev->next = entry->next;
+	else
+		q->head = entry->next;
 
+	if(entry->next)
+		entry->next->prev = entry->prev;
+	else
+		q->tail = entry->prev;
+
+	entry->prev = entry->next = NULL;
+	return entry;
 }
 
 /*
-* Dequeue a command entry
+* Dequeue a command entry from one of the queues on a bus
 */
 
-static CmdEntryPtr_t dequeueCommand()
+static CmdEntryPtr_t dequeueCommand(BusEntryPtr_t bus, CmdClass_t class)
 {
-	CmdEntryPtr_t entry;
-
-	if(!cmdEntryHead){
-		entry = NULL;
-	}
-	else if(cmdEntryHead == cmdEntryTail){
-		entry = cmdEntryHead;
-		entry->prev = entry->next = cmdEntryHead = cmdEntryTail = NULL;
-	}
-	else{
-		entry = cmdEntryHead;
-		cmdEntryHead = cmdEntryHead->next;
-		entry->prev = entry->next = cmdEntryHead->prev = NULL;	
-	}
-	return entry;
+	CmdQueuePtr_t q = &bus->cmdQueue[class];
 
+	return unlinkCommand(bus, q, q->head);
 }
 
 /*
-* Free a command entry
+* Return a command entry to the pool on a bus
 */
 
-static void freeCommand( CmdEntryPtr_t e)
+static void freeCommand(BusEntryPtr_t bus, CmdEntryPtr_t e)
 {
 	if(e){
-		if(e->cmd)
-			free(e->cmd);
-		free(e);
+		/* Later requests of the same type start a new query */
+		if((e->ze) && (e->ze->query[e->type] == e))
+			e->ze->query[e->type] = NULL;
+		e->ze = NULL;
+		e->prev = NULL;
+		e->next = bus->cmdFree;
+		bus->cmdFree = e;
 	}
 }
 
 /*
- * De-queue and free current command
- */
-  
-static void dequeueAndFreeCommand()
+* Create the command entry pool for a bus.
+* Every queued command uses an entry from the pool, so the memory used by the command
+* queues is fixed at start up, and nothing is allocated once the bus is running.
+*/
+
+static void busCreatePool(BusEntryPtr_t bus)
 {
-		if(cmdEntryTail){
-			CmdEntryPtr_t ctf = dequeueCommand();
-			freeCommand(ctf);
-		}
-}
+	unsigned i;
 
+	if(!(bus->cmdPool = mallocz(queueSize * sizeof(CmdEntry_t))))
+		MALLOC_ERROR;
+	for(i = queueSize; i > 0; i--)
+		freeCommand(bus, &bus->cmdPool[i - 1]);
+	debug(DEBUG_ACTION, "Command pool on bus %s has %u entries, %u bytes", bus->name, queueSize,
+	(unsigned) (queueSize * sizeof(CmdEntry_t)));
+}
 
 /*
-* Match a command from a NULL-terminated list, return index to list entry
+* Take a command entry from the pool on a bus.
+* The queue depth limit of a bus is less than the pool size, with room for the command in 
+* progress, so busAdmit() rejects a command before the pool can run out. NULL is only
+* returned if that is broken.
 */
 
-static int matchCommand(const String *commandList, const String command)
+static CmdEntryPtr_t allocCommand(BusEntryPtr_t bus)
 {
-	int i;
-	
-	if((!command) || (!commandList))
-		return -1;
+	CmdEntryPtr_t e;
 
-	for(i = 0; commandList[i]; i++){
-		if(!strcmp(command, commandList[i]))
-			break;
-	}
-	return i;	
+	if(!(e = bus->cmdFree))
+		return NULL;
+	bus->cmdFree = e->next;
+	e->next = NULL;
+	return e;
 }
 
+
 /*
-* Make a comma delimited string from a NULL terminated array of string pointers
+* Queue one command entry on a bus, in the queue for its scheduling class.
+* If an unsent basic command for the same zone and field is already queued, 
+* it is replaced in place instead.
 */
 
-
-static String makeCommaList(String ws, const String *list)
+static void queueEntry(BusEntryPtr_t bus, ZoneEntryPtr_t ze, String cmd, CmdType_t type, uint64_t queued)
 {
-	int i;
+	CmdQueuePtr_t q = &bus->cmdQueue[cmdClass(type)];
+	CmdEntryPtr_t newCE, old;
+	rc65Field_t field = RC65_NONE;
+	char ws[WS_SIZE];
+	
+	/* Upper case copy of the command string */
+	confreadStringCopy(ws, cmd, WS_SIZE);
+	str2Upper(ws);
 
-	if(!list || !ws)
-		return NULL;
+	if((ze) && (cmdClass(type) == CMDCLASS_REQUEST) && (ze->query[type])){ /* Single flight */
+		debug(DEBUG_ACTION, "Request %s joined one already in progress", ws);
+		atomic_fetch_add_explicit(&bus->joined, 1, memory_order_relaxed);
+		return;
+	}
 
-	ws[0] = 0;
+	if((type == CMDTYPE_BASIC) && (ze))
+		field = cmdField(ws);
+	
+	if((field != RC65_NONE) && (old = ze->pending[field])){ /* Last writer wins */
+		debug(DEBUG_ACTION, "Command %s superseded by %s", old->cmd, ws);
+		strcpy(old->cmd, ws);
+		atomic_fetch_add_explicit(&bus->superseded, 1, memory_order_relaxed);
+		return;
+	}
 
-	for(i = 0; list[i]; i++){
-		if(i)
-			strcat(ws, ",");
-		strcat(ws, list[i]);
+	if(!(newCE = allocCommand(bus))){
+		debug(DEBUG_UNEXPECTED, "Command pool on bus %s is empty, command dropped: %s", bus->name, ws);
+		return;
 	}
+	
+	strcpy(newCE->cmd, ws);
+		
+	/* Save the optional zone entry in the queued command */
+	newCE->ze = ze;
 
-	return ws;
+	/* Save the type, field and the time it was queued */
+	newCE->type = type;
+	newCE->field = field;
+	newCE->queued = queued;
+
+	if(field != RC65_NONE)
+		ze->pending[field] = newCE;
+	else if((ze) && (cmdClass(type) == CMDCLASS_REQUEST))
+		ze->query[type] = newCE;
+
+	if(!q->head){ /* Empty list */
+		q->head = q->tail =  newCE;
+	}
+	else{ /* List not empty */
+		q->tail->next = newCE;
+		newCE->prev = q->tail;
+		q->tail = newCE;
+	}
+
+	/* Queue depth high water marks */
+	if(++bus->depth > atomic_load_explicit(&bus->depthMax, memory_order_relaxed))
+		atomic_store_explicit(&bus->depthMax, bus->depth, memory_order_relaxed);
+	if((ze) && (++ze->depth > atomic_load_explicit(&ze->depthMax, memory_order_relaxed)))
+		atomic_store_explicit(&ze->depthMax, ze->depth, memory_order_relaxed);
 }
 
 /*
-* Command hander for hvac-mode
+* Check there is room to queue a command of n entries on a bus.
+* If the queue depth limit of the bus or of the zone would be exceeded, the command is
+* rejected, and an hvac.gateway busy trigger tells the sender to slow down.
+* Requests which join one in progress do not take up any room.
 */
 
-static String doHVACMode(String ws, xPL_MessagePtr theMessage, ZoneEntryPtr_t ze)
+static Bool busAdmit(BusEntryPtr_t bus, ZoneEntryPtr_t ze, String cmd, CmdType_t type, unsigned n)
 {
-	String res = NULL;
-	int i;
-	const String const mode = xPL_getMessageNamedValue(theMessage, "mode");
+	BusEvent_t ev;
 
-	if(!ze || !ws)
-		return res;
+	if((ze) && (cmdClass(type) == CMDCLASS_REQUEST) && (ze->query[type]))
+		return TRUE;
+	if((bus->depth + n <= bus->queueDepth) && ((!ze) || (ze->depth + n <= ze->queueDepth)))
+		return TRUE;
 
-	if(mode){
-		i = matchCommand(modeList, mode);
-		if((i >= 0) && (modeList[i])){
-			strcat(ws, " ");
-			res = strcat(ws, modeCommands[i]);
-		}
+	debug(DEBUG_UNEXPECTED, "Bus %s is busy, command dropped: %s", bus->name, cmd);
+	atomic_fetch_add_explicit(&bus->busy, 1, memory_order_relaxed);
+	if(ze){
+		memset(&ev, 0, sizeof(ev));
+		ev.type = BUSEVENT_BUSY;
+		ev.cmdType = type;
+		ev.ze = ze;
+		busEmit(bus, &ev);
 	}
-	return res;
+	return FALSE;
 }
 
 /*
-* Command handler for fan mode
+* Queue a command on a bus.
+* Basic commands are split up and queued one field at a time so that each field can
+* be superseded on its own. They are merged again by busCoalesce() when sent.
+* A command for an offline zone fails as a whole, with one failure event.
 */
 
-static String doFanMode(String ws, xPL_MessagePtr theMessage, ZoneEntryPtr_t ze)
+static void queueCommand(BusEntryPtr_t bus, ZoneEntryPtr_t ze, String cmd, CmdType_t type, uint64_t queued)
 {
-	String res = NULL;
-	int i;
-	const String const mode = xPL_getMessageNamedValue(theMessage, "mode"); /* Get the mode */
+	char ws[WS_SIZE];
+	const char *f;
+	size_t len;
+	unsigned n;
+	rc65Field_t field;
 
-	if(!ze || !ws)
-		return res;
+	if((ze) && (ze->state->health == ZONE_DEAD)){ /* Fast fail */
+		busFailCommand(bus, ze, cmd, type);
+		return;
+	}
 
-	if(mode){
-		i = matchCommand(fanModeList, mode);
-		if((i >= 0) && (fanModeList[i])){
-			strcat(ws, " ");
-			res = strcat(ws, fanModeCommands[i]);
-		}
+	if((type != CMDTYPE_BASIC) || (!ze) || (!(f = strchr(cmd, ' ')))){
+		if(busAdmit(bus, ze, cmd, type, 1))
+			queueEntry(bus, ze, cmd, type, queued);
+		return;
+	}
+
+	/* All the fields of a basic command are queued, or none of them are. Fields which supersede one already queued take no room. */
+	for(n = 0; *f; f += len){
+		while(*f == ' ')
+			f++;
+		if(!*f)
+			break;
+		len = strcspn(f, " ");
+		snprintf(ws, WS_SIZE, "A=%u %.*s", ze->address, (int) len, f);
+		str2Upper(ws);
+		if(((field = cmdField(ws)) == RC65_NONE) || (!ze->pending[field]))
+			n++;
+	}
+	if(!busAdmit(bus, ze, cmd, type, n))
+		return;
+
+	for(f = strchr(cmd, ' '); *f; f += len){
+		while(*f == ' ')
+			f++;
+		if(!*f)
+			break;
+		len = strcspn(f, " ");
+		snprintf(ws, WS_SIZE, "A=%u %.*s", ze->address, (int) len, f);
+		queueEntry(bus, ze, ws, type, queued);
 	}
-	return res;
 }
 
 /*
-* Command handler for setpoints
+* Return the monotonic clock in milliseconds
 */
 
-static String doSetSetpoint(String ws, xPL_MessagePtr theMessage, ZoneEntryPtr_t ze)
+static uint64_t monotonicMs(void)
 {
-	String res = NULL;
-	String setpoint, temperature;
-	int cmd;
-
-	
-	if(!ze || !ws)
-		return res;
+	struct timespec ts;
 
-	setpoint = xPL_getMessageNamedValue(theMessage, "setpoint");
-	temperature = xPL_getMessageNamedValue(theMessage, "temperature");
-
-	if(setpoint && temperature){
-		if(!strcmp(setpoint, setPointList[0])){
-			res = ws;
-			cmd = 0;
-		}
-		else if(!strcmp(setpoint, setPointList[1])){
-			res = ws;
-			cmd = 1;
-		}
-		if(res)
-			sprintf(ws + strlen(ws)," %s=%s", setPointCommands[cmd], temperature);
-	}
-	return res;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
 }
 
-
-
 /*
-* Send a display update command
+* Arm a timer fd to go off at an absolute time on the monotonic ms clock
 */
 
-static String doDisplay(String ws, xPL_MessagePtr theMessage, ZoneEntryPtr_t ze)
+static Bool armTimer(int fd, uint64_t when)
 {
-	String val, state, res = NULL;
+	struct itimerspec its;
 
-	if(!ws || !ze || !theMessage)
-		return res;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = when / 1000;
+	its.it_value.tv_nsec = (when % 1000) * 1000000;
+	if(!its.it_value.tv_sec && !its.it_value.tv_nsec) /* Zero would disarm the timer */
+		its.it_value.tv_nsec = 1;
 
-	/* Outside Temperature */
-	val = xPL_getMessageNamedValue(theMessage, displayList[0]);
-	if(val){
-		res = ws;
-		sprintf(ws+strlen(ws), " OT=%s", val);
-	}
+	return (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) ? FALSE : TRUE;
+}
 
-	/* Display lock */
-	val = xPL_getMessageNamedValue(theMessage, displayList[1]);
-	if(val){
-		if((!strcmp(val, "on"))||(!strcmp(val, "yes"))||(!strcmp(val, "1")))
-			state = "1";
-		else
-			state = "0";
-		res = ws;
-		sprintf(ws+strlen(ws), " DL=%s", state);
-	}
+/*
+* Arm the bus timer
+*/
 
-	return res;	
+static void busArmTimer(BusEntryPtr_t bus, uint64_t when)
+{
+	if(!armTimer(bus->timerfd, when))
+		debug(DEBUG_UNEXPECTED, "Could not set timer for bus %s: %s", bus->name, strerror(errno));
 }
 
 /*
- * Build run time command
- */
- 
-static String buildRTCmd(String ws, char rq, String setQuery)
-{
-	if(!ws)
-		return NULL;
-		
-	if(!setQuery)
-		setQuery = "?";
-	
-	sprintf(ws+strlen(ws), " RT%c=%s", rq, setQuery);
+* End the current transaction, and start the inter-frame gap
+*/
 
-	return ws;
+static void busEndTransaction(BusEntryPtr_t bus, uint64_t now)
+{
+	bus->state = BUSSTATE_GAP;
+	bus->deadline = now + bus->gap;
 }
 
 /*
- * Do get runtime command
- */
+* Return TRUE if a frame already sets any of the fields in a list of key=value fields
+*/
 
-static void doGetRT(String ws, xPL_MessagePtr theMessage, ZoneEntryPtr_t ze)
+static Bool frameHasField(const String frame, const String fields)
 {
-	char rq;
-	
-	String state = xPL_getMessageNamedValue(theMessage, "state");
-	
-	if(!ws || !theMessage || !ze || !state) /* Must have valid pointers */
-		return;
-		
-	if(!strcmp(state, setPointList[0])){ /* heating */
-		rq = 'H';
+	char needle[16];
+	const char *f, *eq;
+	size_t len;
+
+	for(f = fields; *f; f += len){
+		while(*f == ' ')
+			f++;
+		if(!*f)
+			break;
+		len = strcspn(f, " ");
+		if(!(eq = memchr(f, '=', len)) || ((eq - f) + 3 > sizeof(needle)))
+			continue;
+		snprintf(needle, sizeof(needle), " %.*s=", (int) (eq - f), f);
+		if(strstr(frame, needle))
+			return TRUE;
 	}
-	else if(!strcmp(state, setPointList[1])){ /* cooling */
-		rq = 'C';
+	return FALSE;
+}
+
+/*
+* Merge the fields of later basic commands for the same zone into a basic command about 
+* to be sent, as long as the frame stays within the maximum frame length.
+* Stops at the first command which sets a field already in the frame, so commands
+* for a zone still take effect in the order they were received.
+*/
+
+static void busCoalesce(BusEntryPtr_t bus, CmdEntryPtr_t ce)
+{
+	CmdQueuePtr_t q = &bus->cmdQueue[CMDCLASS_INTERACTIVE];
+	CmdEntryPtr_t e, next;
+	String fields;
+	size_t len;
+
+	for(e = q->head; e; e = next){
+		next = e->next;
+		if((e->type != CMDTYPE_BASIC) || (e->ze != ce->ze))
+			continue;
+		if(!(fields = strchr(e->cmd, ' '))) /* Fields follow the address */
+			continue;
+		len = strlen(ce->cmd) + strlen(fields);
+		if((len > maxFrameLength) || (frameHasField(ce->cmd, fields)))
+			break;
+		strcat(ce->cmd, fields); /* The maximum frame length is less than WS_SIZE */
+		freeCommand(bus, unlinkCommand(bus, q, e));
+		atomic_fetch_add_explicit(&bus->coalesced, 1, memory_order_relaxed);
+	}
+}
+
+/*
+* Plan the next poll. 
+* The zone which has been due the longest is polled next, but not before the poll budget allows.
+*/
+
+static void busPlanPolls(BusEntryPtr_t bus)
+{
+	ZoneSchedPtr_t next;
+
+	if(!(next = zone_scan(bus->sched, bus->numZones, sizeof(ZoneSched_t)))){
+		bus->pollZone = NULL;
+		return;
 	}
+	bus->pollZone = &bus->zones[next - bus->sched];
+	/* Verification polls are not held back by the poll budget */
+	if((next->verify) || (next->nextPoll > bus->pollBudgetAt))
+		bus->nextPoll = next->nextPoll;
 	else
+		bus->nextPoll = bus->pollBudgetAt;
+}
+
+/*
+* Adapt the poll interval of a zone once a poll is done, see zone_poll_done().
+* The time the poll kept the bus busy is charged against the poll budget.
+*/
+
+static void busPollDone(BusEntryPtr_t bus, ZoneEntryPtr_t ze, Bool changed, uint64_t now)
+{
+	uint64_t busy = (now + bus->gap) - bus->pollStart;
+
+	zone_poll_done(ze->sched, ze->state, changed, now, probeMax);
+	bus->pollBudgetAt = now + ((busy * (100 - pollBudget)) / pollBudget);
+	busPlanPolls(bus);
+}
+
+/*
+* A zone responded. If it was offline, it is back online.
+*/
+
+static void busZoneHeard(BusEntryPtr_t bus, ZoneEntryPtr_t ze)
+{
+	BusEvent_t ev;
+	ZoneStatePtr_t zs = ze->state;
+
+	zs->misses = 0;
+	if(zs->health == ZONE_DEAD){
+		debug(DEBUG_EXPECTED, "Zone %s at address %u is back online", ze->name, ze->address);
+		zs->pollInterval = zs->pollMin;
+		memset(&ev, 0, sizeof(ev));
+		ev.type = BUSEVENT_ONLINE;
+		ev.ze = ze;
+		busEmit(bus, &ev);
+	}
+	zs->health = ZONE_HEALTHY;
+}
+
+/*
+* A zone did not respond. 
+* The first miss makes it suspect, and deadAfter misses in a row take it offline.
+* Commands still queued for an offline zone are failed, and writes still waiting for
+* a verification poll are reported as reverted to the last polled values.
+*/
+
+static void busZoneMiss(BusEntryPtr_t bus, ZoneEntryPtr_t ze)
+{
+	int class;
+	BusEvent_t ev;
+	CmdEntryPtr_t e, next;
+	ZoneStatePtr_t zs = ze->state;
+
+	if(zs->health == ZONE_DEAD)
 		return;
-	if(buildRTCmd(ws, rq, NULL))	
-		queueCommand(ze, ws, (rq == 'H') ? CMDTYPE_RQ_HEATTIME : CMDTYPE_RQ_COOLTIME); /* Queue the command */
+
+	if(++zs->misses < deadAfter){
+		zs->health = ZONE_SUSPECT;
+		return;
+	}
+
+	debug(DEBUG_UNEXPECTED, "Zone %s at address %u is offline", ze->name, ze->address);
+	zs->health = ZONE_DEAD;
+	zs->probeInterval = probeMin;
+	memset(&ev, 0, sizeof(ev));
+	ev.type = BUSEVENT_OFFLINE;
+	ev.ze = ze;
+	busEmit(bus, &ev);
+
+	if(zs->expect.present){ /* Writes which can't be verified any more */
+		memset(&ev, 0, sizeof(ev));
+		ev.type = BUSEVENT_VERIFIED;
+		ev.cmdType = CMDTYPE_BASIC;
+		ev.ze = ze;
+		ev.checked = ev.changed = zs->expect.present;
+		ev.status = zs->status;
+		busEmit(bus, &ev);
+	}
+	memset(&zs->expect, 0, sizeof(rc65Status_t));
+	ze->sched->verify = FALSE;
+
+	for(class = 0; class < CMDCLASS_COUNT; class++){
+		for(e = bus->cmdQueue[class].head; e; e = next){
+			next = e->next;
+			if(e->ze != ze)
+				continue;
+			unlinkCommand(bus, &bus->cmdQueue[class], e);
+			busFailCommand(bus, ze, e->cmd, e->type);
+			freeCommand(bus, e);
+		}
+	}
 }
 
 /*
- * Reset fan time to zero
- */
- 
-static String doResetRunTime(String ws, xPL_MessagePtr theMessage, ZoneEntryPtr_t ze)
+* A zone was just sent a command, poll it at its minimum poll interval
+*/
+
+static void busZoneActive(BusEntryPtr_t bus, ZoneEntryPtr_t ze, uint64_t now)
 {
+	ZoneStatePtr_t zs = ze->state;
 
-	char rq;
-	
-	String state = xPL_getMessageNamedValue(theMessage, "state");
-	
-	if(!ws || !theMessage || !ze || !state) /* Must have valid pointers */
-		return NULL;
-		
-	if(!strcmp(state, setPointList[0])){ /* heating */
-		rq = 'H';
+	zs->pollInterval = zs->pollMin;
+	if(ze->sched->nextPoll > now + zs->pollInterval){
+		ze->sched->nextPoll = now + zs->pollInterval;
+		busPlanPolls(bus);
 	}
-	else if(!strcmp(state, setPointList[1])){ /* cooling */
-		rq = 'C';
+}
+
+/*
+* Send a poll to a zone, and wait for the response
+*/
+
+static void busSendPoll(BusEntryPtr_t bus, ZoneEntryPtr_t ze, uint64_t now)
+{
+	debug(DEBUG_ACTION, "Polling Status on bus %s A=%d, R=1...", bus->name, ze->address);
+	serio_printf(bus->serio, "A=%d R=1\r", ze->address);
+	ze->sched->nextPoll = now + ze->state->pollInterval; /* Until the poll is done */
+	bus->pollStart = now;
+	bus->pollPending = ze;
+	bus->trans[ze->address].poll = ze;
+	bus->state = BUSSTATE_WAIT;
+	bus->deadline = now + pollTimeout;
+}
+
+/*
+* A basic command went out. Pass the values it wrote on so the xPL side can update its
+* status cache straight away, and poll the zone next to verify them.
+*/
+
+static void busWritten(BusEntryPtr_t bus, CmdEntryPtr_t ce, uint64_t now)
+{
+	uint64_t due;
+	BusEvent_t ev;
+	ZoneEntryPtr_t ze = ce->ze;
+	ZoneStatePtr_t zs = ze->state;
+
+	memset(&ev, 0, sizeof(ev));
+	if(!rc65_decode_command(ce->cmd, &ev.status))
+		return;
+	rc65_merge(&zs->expect, &ev.status, ev.status.present);
+	ze->sched->verify = TRUE;
+
+	ev.type = BUSEVENT_SENT;
+	ev.cmdType = ce->type;
+	ev.ze = ze;
+	ev.changed = ev.status.present;
+	busEmit(bus, &ev);
+
+	/* Ahead of any other zone which is already due */
+	due = ((bus->pollZone) && (bus->pollZone->sched->nextPoll < now)) ? bus->pollZone->sched->nextPoll : now;
+	ze->sched->nextPoll = due;
+	busPlanPolls(bus);
+}
+
+/*
+* Check the values written to a zone against a poll of it.
+* Fields the poll does not report can't be checked, and are taken as written.
+*/
+
+static void busVerify(BusEntryPtr_t bus, ZoneEntryPtr_t ze, const rc65Status_t *st)
+{
+	BusEvent_t ev;
+	ZoneStatePtr_t zs = ze->state;
+
+	memset(&ev, 0, sizeof(ev));
+	if((ev.checked = zs->expect.present & st->present)){
+		ev.type = BUSEVENT_VERIFIED;
+		ev.cmdType = CMDTYPE_BASIC;
+		ev.ze = ze;
+		ev.changed = rc65_diff(&zs->expect, st) & ev.checked; /* Fields which did not take */
+		ev.status = *st;
+		busEmit(bus, &ev);
 	}
-	else
+	memset(&zs->expect, 0, sizeof(rc65Status_t));
+	ze->sched->verify = FALSE;
+}
+
+/*
+* Send a command. Wait for the response if the command type has one.
+*/
+
+static void busSendCommand(BusEntryPtr_t bus, CmdEntryPtr_t ce, uint64_t now)
+{
+	debug(DEBUG_EXPECTED, "Sending command on bus %s: %s", bus->name, ce->cmd);
+	serio_printf(bus->serio, "%s\r", ce->cmd);
+	if(ce->ze)
+		busZoneActive(bus, ce->ze, now);
+	if((ce->ze) && (ce->type == CMDTYPE_BASIC))
+		busWritten(bus, ce, now);
+	if((ce->type == CMDTYPE_DATETIME)||(ce->type == CMDTYPE_BASIC)||(ce->type == CMDTYPE_NONE)){
+		freeCommand(bus, ce); /* These commands do not send back a response */
+		busEndTransaction(bus, now);
+	}
+	else{
+		bus->cmdPending = ce;
+		if(ce->ze)
+			bus->trans[ce->ze->address].cmd = ce;
+		bus->state = BUSSTATE_WAIT;
+		bus->deadline = now + commandTimeout;
+	}
+}
+
+/*
+* A response did not arrive before the deadline. 
+* Depending on the timeout action, arrange for the frame to be sent again, or give up on it
+* and optionally tell the xPL side about it.
+*/
+
+static void busTimeout(BusEntryPtr_t bus, uint64_t now)
+{
+	BusEvent_t ev;
+	Bool dead;
+	ZoneEntryPtr_t ze = NULL;
+
+	if(bus->pollPending)
+		ze = bus->pollPending;
+	else if(bus->cmdPending)
+		ze = bus->cmdPending->ze;
+	dead = ((ze) && (ze->state->health == ZONE_DEAD)) ? TRUE : FALSE;
+
+	if(dead)
+		debug(DEBUG_ACTION, "No response to probe of offline zone %s", ze->name);
+	else if(bus->pollPending)
+		debug(DEBUG_UNEXPECTED, "Did not receive a response from zone %s at address %u", ze->name, ze->address);
+	else if(bus->cmdPending)
+		debug(DEBUG_UNEXPECTED, "Did not receive a response to command: %s", bus->cmdPending->cmd);
+
+	busEndTransaction(bus, now);
+
+	if((timeoutAction == TIMEOUT_RETRY) && (bus->retryCount < timeoutRetries) && (!dead)){
+		/* Keep the pending poll or command, and send it again after the inter-frame gap */
+		bus->retryCount++;
+		bus->retry = TRUE;
+		return;
+	}
+
+	if(ze)
+		busZoneMiss(bus, ze);
+
+	if((timeoutAction == TIMEOUT_TRIGGER) && (ze) && (!dead)){
+		memset(&ev, 0, sizeof(ev));
+		ev.type = BUSEVENT_TIMEOUT;
+		ev.cmdType = bus->cmdPending ? bus->cmdPending->type : CMDTYPE_NONE;
+		ev.ze = ze;
+		busEmit(bus, &ev);
+	}
+
+	if(bus->cmdPending){
+		if(bus->cmdPending->ze)
+			bus->trans[bus->cmdPending->ze->address].cmd = NULL;
+		freeCommand(bus, bus->cmdPending);
+		bus->cmdPending = NULL;
+	}
+	if(bus->pollPending){
+		bus->trans[bus->pollPending->address].poll = NULL;
+		busPollDone(bus, bus->pollPending, FALSE, now);
+		bus->pollPending = NULL;
+	}
+	bus->retry = FALSE;
+	bus->retryCount = 0;
+}
+
+/*
+* Pick the scheduling class to service next, or return -1 if there is nothing to do.
+*
+* Each class starts at its own priority level, and gains one level for every queueAging
+* milliseconds its oldest entry has been waiting, so lower classes are never starved.
+* Ties go to the class with the higher base priority.
+*/
+
+static int busSelectClass(BusEntryPtr_t bus, uint64_t now)
+{
+	int class, best = -1;
+	long level, bestLevel = 0;
+	uint64_t since;
+
+	for(class = 0; class < CMDCLASS_COUNT; class++){
+		if(class == CMDCLASS_POLL){
+			if((now < bus->nextPoll) || (!bus->numZones))
+				continue;
+			since = bus->nextPoll;
+		}
+		else if(bus->cmdQueue[class].head)
+			since = bus->cmdQueue[class].head->queued;
+		else
+			continue;
+
+		level = (long) class - (long) ((now - since) / queueAging);
+		if((best < 0) || (level < bestLevel)){
+			best = class;
+			bestLevel = level;
+		}
+	}
+	return best;
+}
+
+/*
+* Update the latency counters for a class
+*/
+
+static void busRecordLatency(BusEntryPtr_t bus, CmdClass_t class, uint64_t latency)
+{
+	ClassStatsPtr_t cs = &bus->stats[class];
+	unsigned ms = (latency > UINT_MAX) ? UINT_MAX : (unsigned) latency;
+
+	atomic_fetch_add_explicit(&cs->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&cs->totalMs, latency, memory_order_relaxed);
+	if(ms > atomic_load_explicit(&cs->maxMs, memory_order_relaxed)) /* Only the bus writes this */
+		atomic_store_explicit(&cs->maxMs, ms, memory_order_relaxed);
+}
+
+/*
+* Bus transaction scheduler.
+* 
+* Sends the next frame as soon as the bus is free. The bus is free once the response to
+* the last frame has arrived or timed out, and the inter-frame gap has passed. Retries are
+* sent first, then the rest is sent in priority order as chosen by busSelectClass(). 
+* The bus timer is armed for the next time something needs to happen.
+*/
+
+static void busKick(BusEntryPtr_t bus)
+{
+	int class;
+	uint64_t now, wake;
+	CmdEntryPtr_t ce;
+
+	if(!bus->serio) /* Nothing to do until the port is back */
+		return;
+
+	now = monotonicMs();
+
+	if(bus->state == BUSSTATE_WAIT){
+		if(now < bus->deadline){
+			busArmTimer(bus, bus->deadline);
+			return;
+		}
+		busTimeout(bus, now);
+	}
+
+	if(bus->state == BUSSTATE_GAP){
+		if(now < bus->deadline){
+			busArmTimer(bus, bus->deadline);
+			return;
+		}
+		bus->state = BUSSTATE_IDLE;
+	}
+
+	if(bus->retry && (bus->pollPending || bus->cmdPending)){ /* If retry pending */
+		debug(DEBUG_ACTION, "Retry %u of %u on bus %s", bus->retryCount, timeoutRetries, bus->name);
+		if(bus->pollPending)
+			busSendPoll(bus, bus->pollPending, now);
+		else
+			busSendCommand(bus, bus->cmdPending, now);
+	}
+	else{
+		/* A late response may have arrived during the gap */
+		bus->retry = FALSE;
+		bus->retryCount = 0;
+
+		class = busSelectClass(bus, now);
+		if(class == CMDCLASS_POLL){ /* Poll is due */
+			busRecordLatency(bus, class, now - bus->nextPoll);
+			busSendPoll(bus, bus->pollZone, now);
+			busPlanPolls(bus);
+		}
+		else if((class >= 0) && (ce = dequeueCommand(bus, class))){ /* Queued command */
+			busRecordLatency(bus, class, now - ce->queued);
+			if(ce->type == CMDTYPE_BASIC)
+				busCoalesce(bus, ce);
+			busSendCommand(bus, ce, now);
+		}
+	}
+
+	if(bus->state != BUSSTATE_IDLE)
+		wake = bus->deadline;
+	else if(bus->numZones)
+		wake = bus->nextPoll;
+	else /* Nothing to poll, sleep until a command arrives */
+		wake = now + (bus->pollRate * 1000);
+	busArmTimer(bus, wake);
+}
+
+/*
+* Find a zone by name on any bus. Return NULL if it does not exist.
+*
+* Zones are found through zoneTable, an open addressing hash table on the zone name
+* with linear probing. The table size is a power of 2 and is kept at most half full
+* so that a probe always ends at an empty slot.
+*/
+
+static ZoneEntryPtr_t findZone(const String name)
+{
+	uint32_t hash;
+	unsigned i;
+	ZoneEntryPtr_t ze;
+
+	if((!name) || (!zoneTable))
 		return NULL;
-		
-	buildRTCmd(ws, rq, "0");	
-	
-	return ws;
+
+	hash = confreadHash(name);
+	for(i = hash & (zoneTableSize - 1); (ze = zoneTable[i]); i = (i + 1) & (zoneTableSize - 1)){
+		if((ze->hash == hash) && (!strcmp(ze->name, name)))
+			return ze;
+	}
+	return NULL;
 }
 
+/*
+* Add a zone to the zone table, growing the table when it would become more than half full
+*/
+
+static void registerZone(ZoneEntryPtr_t ze)
+{
+	unsigned i, j, oldSize;
+	ZoneEntryPtr_t *oldTable;
+
+	if((numZones + 1) * 2 > zoneTableSize){
+		oldTable = zoneTable;
+		oldSize = zoneTableSize;
+		zoneTableSize = (oldSize) ? oldSize * 2 : 16;
+		if(!(zoneTable = mallocz(zoneTableSize * sizeof(ZoneEntryPtr_t))))
+			MALLOC_ERROR;
+		for(j = 0; j < oldSize; j++){
+			if(oldTable[j]){
+				for(i = oldTable[j]->hash & (zoneTableSize - 1); zoneTable[i]; i = (i + 1) & (zoneTableSize - 1));
+				zoneTable[i] = oldTable[j];
+			}
+		}
+		free(oldTable);
+	}
+
+	ze->hash = confreadHash(ze->name);
+	for(i = ze->hash & (zoneTableSize - 1); zoneTable[i]; i = (i + 1) & (zoneTableSize - 1));
+	zoneTable[i] = ze;
+	numZones++;
+}
 
 /*
- * Do get fantime command
- */
+* Find a bus by its id. Return NULL if it does not exist.
+*/
 
-static void doGetFT(String ws, xPL_MessagePtr theMessage, ZoneEntryPtr_t ze)
+static BusEntryPtr_t findBus(int id)
 {
-	char rq;
-	
-	String state = xPL_getMessageNamedValue(theMessage, "state");
-	
-	if(!ws || !theMessage || !ze || !state) /* Must have valid pointers */
+	BusEntryPtr_t bus;
+
+	for(bus = busEntryHead; bus; bus = bus->next){
+		if(bus->id == id)
+			break;
+	}
+	return bus;
+}
+
+/*
+* Forward declaration, doGatewayEvent() sends hvac.gateway triggers
+*/
+
+static void doGatewayEvent(BusEventPtr_t ev);
+
+/*
+* Submit a command to a bus from the xPL side.
+* In threaded mode, the command is passed to the bus thread through its command ring,
+* otherwise it is queued directly.
+*/
+
+static void submitCommand(BusEntryPtr_t bus, ZoneEntryPtr_t ze, String cmd, CmdType_t type)
+{
+	BusCmd_t bc;
+	BusEvent_t ev;
+	uint64_t one = 1;
+
+	if(!bus || !cmd)
+		return;
+
+	if(!threadedMode){
+		queueCommand(bus, ze, cmd, type, monotonicMs());
+		busKick(bus);
 		return;
-		
-	if(!strcmp(state, fanStateList[0])){ /* running */
-		rq = 'F';
 	}
-	else
+
+	bc.type = type;
+	bc.queued = monotonicMs();
+	bc.ze = ze;
+	confreadStringCopy(bc.cmd, cmd, WS_SIZE);
+	if(!spsc_push(bus->cmdRing, &bc)){
+		debug(DEBUG_UNEXPECTED, "Command ring full on bus %s, command dropped: %s", bus->name, cmd);
+		atomic_fetch_add_explicit(&bus->busy, 1, memory_order_relaxed);
+		if(ze){
+			memset(&ev, 0, sizeof(ev));
+			ev.type = BUSEVENT_BUSY;
+			ev.cmdType = type;
+			ev.ze = ze;
+			doGatewayEvent(&ev);
+		}
 		return;
-		
-	if(buildRTCmd(ws, rq, NULL))	
-		queueCommand(ze, ws, CMDTYPE_RQ_FANTIME); /* Queue the command */
-	
+	}
+	if(write(bus->cmdfd, &one, sizeof(one)) < 0)
+		debug(DEBUG_UNEXPECTED, "Could not wake bus thread: %s", strerror(errno));
 }
 
 /*
- * Reset fan time to zero
- */
- 
-static String doResetFanTime(String ws, xPL_MessagePtr theMessage, ZoneEntryPtr_t ze)
+* Match a command from a NULL-terminated list, return index to list entry
+*/
+
+static int matchCommand(const String *commandList, const String command)
 {
-	char rq;
-	
-	String state = xPL_getMessageNamedValue(theMessage, "state");
+	int i;
 	
-	if(!ws || !theMessage || !ze || !state) /* Must have valid pointers */
-		return NULL;
-		
-	if(!strcmp(state, fanStateList[0])){ /* running */
-		rq = 'F';
+	if((!command) || (!commandList))
+		return -1;
+
+	for(i = 0; commandList[i]; i++){
+		if(!strcmp(command, commandList[i]))
+			break;
 	}
-	else
+	return i;	
+}
+
+/*
+* Make a comma delimited string from a NULL terminated array of string pointers
+*/
+
+
+static String makeCommaList(String ws, const String *list)
+{
+	int i;
+
+	if(!list || !ws)
 		return NULL;
-		
-	buildRTCmd(ws, rq, "0");	
-	
+
+	ws[0] = 0;
+
+	for(i = 0; list[i]; i++){
+		if(i)
+			strcat(ws, ",");
+		strcat(ws, list[i]);
+	}
+
 	return ws;
 }
 
+/*
+ * Return the run time field for an xPL state, or RC65_NONE if the state is not one of them
+ */
+
+static rc65Field_t runTimeField(const String state, const rc65Field_t *fields)
+{
+	if(!state)
+		return RC65_NONE;
+
+	for(; *fields != RC65_NONE; fields++){
+		if(!strcmp(state, rc65_xpl_name(*fields)))
+			return *fields;
+	}
+	return RC65_NONE;
+}
+
+/* Run time fields by state */
+
+static const rc65Field_t runTimeFields[] = {RC65_RTH, RC65_RTC, RC65_NONE};
+static const rc65Field_t fanTimeFields[] = {RC65_RTF, RC65_NONE};
+
+/*
+* Return the set point field for an xPL set point name, or RC65_NONE if it is not one of them
+*/
+
+static rc65Field_t setPointField(const String setpoint)
+{
+	if(!setpoint)
+		return RC65_NONE;
+	if(!strcmp(setpoint, rc65_xpl_name(RC65_SPH)))
+		return RC65_SPH;
+	if(!strcmp(setpoint, rc65_xpl_name(RC65_SPC)))
+		return RC65_SPC;
+	return RC65_NONE;
+}
+
+/*
+* Parse a field value from a message into an hvac message structure
+*/
+
+static void parseValue(HvacMsgPtr_t hm, rc65Field_t f, const String val)
+{
+	if((f != RC65_NONE) && (val) && (rc65_parse(f, val, &hm->value[f])))
+		hm->valid |= RC65_BIT(f);
+}
+
+/*
+* Parse an hvac.basic or hvac.request message in one pass over its name/value pairs.
+* Values are converted to fields and field values for the command or request in the message.
+*/
+
+static void parseHvacMsg(xPL_MessagePtr theMessage, Bool basic, HvacMsgPtr_t hm)
+{
+	xPL_NameValueListPtr body = xPL_getMessageBody(theMessage);
+	xPL_NameValuePairPtr nv;
+	String command = NULL, zone = NULL, mode = NULL, setpoint = NULL, temperature = NULL;
+	String state = NULL, outside = NULL, lock = NULL;
+	int i, n = xPL_getNamedValueCount(body);
+
+	hm->command = -1;
+	hm->ze = NULL;
+	hm->field = RC65_NONE;
+	hm->valid = 0;
+
+	/* The first value for each key is the one used */
+	for(i = 0; i < n; i++){
+		if(!(nv = xPL_getNamedValuePairAt(body, i)) || (!nv->itemName) || (!nv->itemValue))
+			continue;
+		if(!strcmp(nv->itemName, basic ? "command" : "request"))
+			command = command ? command : nv->itemValue;
+		else if(!strcmp(nv->itemName, "zone"))
+			zone = zone ? zone : nv->itemValue;
+		else if(!strcmp(nv->itemName, "mode"))
+			mode = mode ? mode : nv->itemValue;
+		else if(!strcmp(nv->itemName, "setpoint"))
+			setpoint = setpoint ? setpoint : nv->itemValue;
+		else if(!strcmp(nv->itemName, "temperature"))
+			temperature = temperature ? temperature : nv->itemValue;
+		else if(!strcmp(nv->itemName, "state"))
+			state = state ? state : nv->itemValue;
+		else if(!strcmp(nv->itemName, rc65_xpl_name(RC65_OT)))
+			outside = outside ? outside : nv->itemValue;
+		else if(!strcmp(nv->itemName, rc65_xpl_name(RC65_DL)))
+			lock = lock ? lock : nv->itemValue;
+	}
+
+	if(zone){
+		debug(DEBUG_ACTION,"Zone present");
+		if((hm->ze = findZone(zone)))
+			debug(DEBUG_ACTION,"Zone entry found");
+	}
+	if(!command)
+		return;
+	debug(DEBUG_ACTION, basic ? "Command = %s" : "Request = %s", command);
+
+	if(basic){
+		switch((hm->command = matchCommand(basicCommandList, command))){
+			case 0: /* hvac-mode */
+				parseValue(hm, RC65_M, mode);
+				break;
+
+			case 1: /* fan-mode */
+				parseValue(hm, RC65_FM, mode);
+				break;
+
+			case 2: /* setpoint */
+				if(setpoint && temperature){
+					parseValue(hm, hm->field = setPointField(setpoint), temperature);
+					if(!hm->valid)
+						debug(DEBUG_UNEXPECTED, "Invalid set point %s=%s", setpoint, temperature);
+				}
+				break;
+
+			case 3: /* display */
+				parseValue(hm, RC65_OT, outside);
+				parseValue(hm, RC65_DL, lock);
+				break;
+
+			case 4: /* reset-runtime */
+			case 5: /* reset-fantime */
+				hm->field = runTimeField(state, (hm->command == 4) ? runTimeFields : fanTimeFields);
+				if(hm->field != RC65_NONE){
+					hm->value[hm->field] = 0;
+					hm->valid |= RC65_BIT(hm->field);
+				}
+				break;
+
+			default:
+				break;
+		}
+	}
+	else{
+		switch((hm->command = matchCommand(requestCommandList, command))){
+			case 3: /* setpoint */
+				hm->field = setPointField(setpoint);
+				break;
+
+			case 5: /* runtime */
+				hm->field = runTimeField(state, runTimeFields);
+				break;
+
+			case 6: /* fantime */
+				hm->field = runTimeField(state, fanTimeFields);
+				break;
+
+			default:
+				break;
+		}
+	}
+}
+
+/*
+* Build a basic command from the field values in a parsed message.
+* Returns NULL if there is nothing to set.
+*/
+
+static String doBasicCommand(String ws, HvacMsgPtr_t hm)
+{
+	rc65Field_t f;
+	String res = NULL;
+
+	if(!ws || !hm->ze)
+		return NULL;
+
+	for(f = 0; f < RC65_FIELDS; f++){
+		if((hm->valid & RC65_BIT(f)) && (rc65_encode(ws, WS_SIZE, f, hm->value[f])))
+			res = ws;
+	}
+	return res;
+}
+
+/*
+ * Do get runtime command
+ */
+
+static void doGetRT(String ws, HvacMsgPtr_t hm)
+{
+	if(!ws || !hm->ze || (hm->field == RC65_NONE)) /* Must have a zone and a state */
+		return;
 
+	if(rc65_encode_query(ws, WS_SIZE, hm->field))	
+		submitCommand(hm->ze->bus, hm->ze, ws, (hm->field == RC65_RTH) ? CMDTYPE_RQ_HEATTIME : CMDTYPE_RQ_COOLTIME); /* Queue the command */
+}
+
+/*
+ * Do get fantime command
+ */
+
+static void doGetFT(String ws, HvacMsgPtr_t hm)
+{
+	if(!ws || !hm->ze || (hm->field == RC65_NONE)) /* Must have a zone and a state */
+		return;
+		
+	if(rc65_encode_query(ws, WS_SIZE, hm->field))	
+		submitCommand(hm->ze->bus, hm->ze, ws, CMDTYPE_RQ_FANTIME); /* Queue the command */
+}
 
 /*
 * Return Gateway info 
@@ -863,7 +1871,93 @@ static void doGateInfo()
 	xPL_setMessageNamedValue(xplrcsStatusMessage, "zone-count", "1");
 
 	if(!xPL_sendMessage(xplrcsStatusMessage))
-		debug(DEBUG_UNEXPECTED, "request.gateinfo status transmission failed");
+		debug(DEBUG_UNEXPECTED, "request.gateinfo status transmission failed");
+}
+
+/*
+* Return gateway statistics
+* Reports the number of frames sent, and the average and maximum queueing latency in
+* milliseconds for each scheduling class, the number of coalesced, superseded and failed 
+* commands, the number of commands dropped because a command queue was full or a queue depth 
+* limit was reached, and the number of stray lines dropped, summed over all buses, the 
+* highest queue depth seen on any bus, and the number of commands handled by the listener.
+* When built with ALLOCSTAT, also reports the number of heap allocations made while handling them.
+*/
+
+static void doGateStats(String ws)
+{
+	int class;
+	unsigned count, maxMs, m, coalesced = 0, superseded = 0, failed = 0, stray = 0, joined = 0, busy = 0, depthMax = 0;
+	unsigned long long totalMs;
+	char value[24];
+	BusEntryPtr_t bus;
+
+	if(!ws)
+		return;
+
+	xPL_setSchema(xplrcsStatusMessage, "hvac", "gatestats");
+
+	xPL_clearMessageNamedValues(xplrcsStatusMessage);
+
+	for(class = 0; class < CMDCLASS_COUNT; class++){
+		count = maxMs = 0;
+		totalMs = 0;
+		for(bus = busEntryHead; bus; bus = bus->next){
+			count += atomic_load_explicit(&bus->stats[class].count, memory_order_relaxed);
+			totalMs += atomic_load_explicit(&bus->stats[class].totalMs, memory_order_relaxed);
+			m = atomic_load_explicit(&bus->stats[class].maxMs, memory_order_relaxed);
+			if(m > maxMs)
+				maxMs = m;
+		}
+		snprintf(ws, WS_SIZE, "%s-count", cmdClassList[class]);
+		snprintf(value, sizeof(value), "%u", count);
+		xPL_addMessageNamedValue(xplrcsStatusMessage, ws, value);
+		snprintf(ws, WS_SIZE, "%s-avg-ms", cmdClassList[class]);
+		snprintf(value, sizeof(value), "%llu", count ? totalMs / count : 0);
+		xPL_addMessageNamedValue(xplrcsStatusMessage, ws, value);
+		snprintf(ws, WS_SIZE, "%s-max-ms", cmdClassList[class]);
+		snprintf(value, sizeof(value), "%u", maxMs);
+		xPL_addMessageNamedValue(xplrcsStatusMessage, ws, value);
+	}
+
+	for(bus = busEntryHead; bus; bus = bus->next){
+		coalesced += atomic_load_explicit(&bus->coalesced, memory_order_relaxed);
+		superseded += atomic_load_explicit(&bus->superseded, memory_order_relaxed);
+		failed += atomic_load_explicit(&bus->failed, memory_order_relaxed);
+		stray += atomic_load_explicit(&bus->stray, memory_order_relaxed);
+		joined += atomic_load_explicit(&bus->joined, memory_order_relaxed);
+		busy += atomic_load_explicit(&bus->busy, memory_order_relaxed);
+		m = atomic_load_explicit(&bus->depthMax, memory_order_relaxed);
+		if(m > depthMax)
+			depthMax = m;
+	}
+	snprintf(value, sizeof(value), "%u", coalesced);
+	xPL_addMessageNamedValue(xplrcsStatusMessage, "coalesced", value);
+	snprintf(value, sizeof(value), "%u", superseded);
+	xPL_addMessageNamedValue(xplrcsStatusMessage, "superseded", value);
+	snprintf(value, sizeof(value), "%u", failed);
+	xPL_addMessageNamedValue(xplrcsStatusMessage, "failed", value);
+	snprintf(value, sizeof(value), "%u", stray);
+	xPL_addMessageNamedValue(xplrcsStatusMessage, "stray", value);
+	snprintf(value, sizeof(value), "%u", busy);
+	xPL_addMessageNamedValue(xplrcsStatusMessage, "busy", value);
+	snprintf(value, sizeof(value), "%u", depthMax);
+	xPL_addMessageNamedValue(xplrcsStatusMessage, "queue-depth-max", value);
+	snprintf(value, sizeof(value), "%u", handledCommands);
+	xPL_addMessageNamedValue(xplrcsStatusMessage, "handled", value);
+#ifdef ALLOCSTAT
+	snprintf(value, sizeof(value), "%u", handledAllocs);
+	xPL_addMessageNamedValue(xplrcsStatusMessage, "handled-allocs", value);
+#endif
+	snprintf(value, sizeof(value), "%u", joined);
+	xPL_addMessageNamedValue(xplrcsStatusMessage, "joined", value);
+	snprintf(value, sizeof(value), "%u", cacheHits);
+	xPL_addMessageNamedValue(xplrcsStatusMessage, "cache-hits", value);
+	snprintf(value, sizeof(value), "%u", cacheMisses);
+	xPL_addMessageNamedValue(xplrcsStatusMessage, "cache-misses", value);
+
+	if(!xPL_sendMessage(xplrcsStatusMessage))
+		debug(DEBUG_UNEXPECTED, "request.gatestats status transmission failed");
 }
 
 /*
@@ -872,7 +1966,8 @@ static void doGateInfo()
 
 static void doZoneList(String ws)
 {
-	int i;
+	unsigned i;
+	BusEntryPtr_t bus;
 	ZoneEntryPtr_t ze;
 	
 	if(!ws)
@@ -887,8 +1982,10 @@ static void doZoneList(String ws)
 	xPL_addMessageNamedValue(xplrcsStatusMessage, "zone-count", ws);
 	
 	/* Add zone names, one per key/value */
-	for(ze = zoneEntryHead, i = 0; ze; ze = ze->next, i++)
-		xPL_addMessageNamedValue(xplrcsStatusMessage, "zone-list", ze->name);
+	for(bus = busEntryHead; bus; bus = bus->next){
+		for(i = 0, ze = bus->zones; i < bus->numZones; i++, ze++)
+			xPL_addMessageNamedValue(xplrcsStatusMessage, "zone-list", ze->name);
+	}
 	
 	if(!xPL_sendMessage(xplrcsStatusMessage))
 		debug(DEBUG_UNEXPECTED, "request.zonelist status transmission failed");
@@ -912,553 +2009,874 @@ static void doZoneInfo(String ws, ZoneEntryPtr_t ze)
 	xPL_setMessageNamedValue(xplrcsStatusMessage, "zone", ze->name);
 
 	xPL_setMessageNamedValue(xplrcsStatusMessage, "command-list", makeCommaList(ws, basicCommandList));
-	xPL_setMessageNamedValue(xplrcsStatusMessage, "hvac-mode-list", makeCommaList(ws, modeList));
-	xPL_setMessageNamedValue(xplrcsStatusMessage, "fan-mode-list", makeCommaList(ws, fanModeList));
+	xPL_setMessageNamedValue(xplrcsStatusMessage, "hvac-mode-list", makeCommaList(ws, rc65_mode_names));
+	xPL_setMessageNamedValue(xplrcsStatusMessage, "fan-mode-list", makeCommaList(ws, rc65_fan_names));
 	xPL_setMessageNamedValue(xplrcsStatusMessage, "setpoint-list", makeCommaList(ws, setPointList));
 	xPL_setMessageNamedValue(xplrcsStatusMessage, "hvac-state-list", makeCommaList(ws, setPointList));
 	xPL_setMessageNamedValue(xplrcsStatusMessage, "fan-state-list", makeCommaList(ws, fanStateList));
 	xPL_setMessageNamedValue(xplrcsStatusMessage, "display-list", makeCommaList(ws, displayList));
+	snprintf(ws, WS_SIZE, "%u", atomic_load_explicit(&ze->depthMax, memory_order_relaxed));
+	xPL_setMessageNamedValue(xplrcsStatusMessage, "queue-depth-max", ws);
 
 
 	if(!xPL_sendMessage(xplrcsStatusMessage))
 		debug(DEBUG_UNEXPECTED, "request.zoneinfo status transmission failed");
 }
 
+/*
+* Forward declaration, doResponseEvent() sends the status message for a request
+*/
+
+static void doResponseEvent(BusEventPtr_t ev);
+
+/*
+* Answer a request from the zone's status cache, if it is fresh enough and has the fields needed.
+* Returns FALSE if the request has to go to the bus.
+*/
+
+static Bool answerFromCache(ZoneEntryPtr_t ze, CmdType_t type, unsigned need)
+{
+	BusEvent_t ev;
+
+	if((!maxStaleness) || (!ze->cacheTime) || (monotonicMs() - ze->cacheTime > maxStaleness) ||
+	((ze->cache.present & need) != need)){
+		cacheMisses++;
+		return FALSE;
+	}
+
+	cacheHits++;
+	memset(&ev, 0, sizeof(ev));
+	ev.type = BUSEVENT_RESPONSE;
+	ev.cmdType = type;
+	ev.ze = ze;
+	ev.status = ze->cache;
+	doResponseEvent(&ev);
+	return TRUE;
+}
+
 /*
 * Return set point info
 */
 
-static void doGetSetPoint(String ws, xPL_MessagePtr theMessage, ZoneEntryPtr_t ze)
+static void doGetSetPoint(String ws, HvacMsgPtr_t hm)
 {
-	String setpoint;
+	CmdType_t type;
 
-	if(!ze || !ws || !theMessage)
+	if(!hm->ze || !ws || (hm->field == RC65_NONE))
 		return;
 
-	setpoint = xPL_getMessageNamedValue(theMessage, "setpoint");
+	type = (hm->field == RC65_SPH) ? CMDTYPE_RQ_SETPOINT_HEAT : CMDTYPE_RQ_SETPOINT_COOL;
+	if(!answerFromCache(hm->ze, type, RC65_BIT(hm->field))){
+		sprintf(ws + strlen(ws), " R=4");
+		submitCommand(hm->ze->bus, hm->ze, ws, type);
+	}
+}
+
+/*
+* Send a request for zone information
+*/
 
+static void doZoneResponse(String ws, ZoneEntryPtr_t ze)
+{
 
+	if(!ze  || !ws)
+		return;
 
-	if(setpoint){
-		sprintf(ws + strlen(ws), " R=4");
+	if(answerFromCache(ze, CMDTYPE_RQ_ZONE, RC65_BIT(RC65_T)))
+		return;
+	
+	sprintf(ws + strlen(ws), " R=1");
+	submitCommand(ze->bus, ze, ws, CMDTYPE_RQ_ZONE);
+}
+
+/*
+* Send the time and date to the thermostats on every bus
+*/
+
+
+static void doSetDateTime()
+{
+	time_t now;
+	struct tm ltime;
+	char ws[WS_SIZE];
+	static int count = 0;
+	BusEntryPtr_t bus;
+
+	time(&now);
+	localtime_r(&now, &ltime);
+
+	if(count >= 3600){
+		count = 0;
+		sprintf(ws, "TIME=%02d:%02d:%02d DATE=%02d/%02d/%02d DOW=%d", ltime.tm_hour, ltime.tm_min,
+		ltime.tm_sec, ltime.tm_mon + 1, ltime.tm_mday, ltime.tm_year % 100, (ltime.tm_wday + 1));
+		debug(DEBUG_ACTION, "Time update command: %s", ws);
+		for(bus = busEntryHead; bus; bus = bus->next)
+			submitCommand(bus, NULL, ws, CMDTYPE_DATETIME);
+	}
+	else
+		count++;
+
+}
+
+
+/*
+* Our Listener 
+* Each hvac command message is parsed once into an hvac message structure on the stack, and 
+* dispatched from it. When built with ALLOCSTAT, the heap allocations made by this thread while
+* handling commands, including those made by libxPL, are counted and reported by request=gatestats.
+*/
 
-		if(!strcmp(setpoint, setPointList[0])){
-			queueCommand(ze, ws, CMDTYPE_RQ_SETPOINT_HEAT);
+
+
+static void xPLListener(xPL_MessagePtr theMessage, xPL_ObjectPtr userValue)
+{
+
+	char ws[WS_SIZE];
+	String cmd = NULL;
+	HvacMsg_t hm;
+#ifdef ALLOCSTAT
+	unsigned allocs = allocstat_count();
+#endif
+
+
+	if(!xPL_isBroadcastMessage(theMessage)){ /* If not a broadcast message */
+		if(xPL_MESSAGE_COMMAND == xPL_getMessageType(theMessage)){ /* If the message is a command */
+			const String iID = xPL_getTargetInstanceID(theMessage);
+			const String type = xPL_getSchemaType(theMessage);
+			const String class = xPL_getSchemaClass(theMessage);
+			
+			if((!strcmp(instanceID, iID)) && (!strcmp(class,"hvac"))){
+				parseHvacMsg(theMessage, !strcmp(type, "basic"), &hm);
+
+				/* Working string, starting with the zone address */
+				if(hm.ze)
+					snprintf(ws, WS_SIZE, "A=%u", hm.ze->address);
+				else
+					ws[0] = 0;
+
+				if(!strcmp(type, "basic")){ /* Basic command schema */
+					if(hm.ze)
+						cmd = doBasicCommand(ws, &hm);
+					if(cmd){
+						submitCommand(hm.ze->bus, hm.ze, cmd, CMDTYPE_BASIC); /* Queue the command */
+					}
+					else{
+						debug(DEBUG_UNEXPECTED, "No command key in message");
+					}
+				}
+				else if(!strcmp(type, "request")){ /* Request command schema */
+					switch(hm.command){
+
+						case 0: /* gateinfo */
+							doGateInfo();
+							break;
+
+						case 1: /* zonelist */
+							doZoneList(ws);
+							break;
+
+						case 2: /* zoneinfo */
+							doZoneInfo( ws, hm.ze );
+							break;
+
+						case 3: /* setpoint */
+							doGetSetPoint(ws, &hm);
+							break;
+
+						case 4: /* zone */
+							doZoneResponse(ws, hm.ze);
+							break;
+							
+						case 5: /* runtime */
+							doGetRT(ws, &hm);
+							break;
+							
+						case 6: /* fantime */
+							doGetFT(ws, &hm);
+							break;
+
+						case 7: /* gatestats */
+							doGateStats(ws);
+							break;
+
+						default:
+							break;
+					}								
+				}
+				handledCommands++;
+#ifdef ALLOCSTAT
+				handledAllocs += allocstat_count() - allocs;
+#endif
+			}
 		}
-		else if(!strcmp(setpoint, setPointList[1])){
-			queueCommand(ze, ws, CMDTYPE_RQ_SETPOINT_COOL);
+
+	}
+}
+
+
+/* 
+* Fields reported in hvac.zone messages. 
+* Set points have their own triggers, and run times are only sent on request.
+*/
+
+#define ZONE_FIELDS (RC65_ALL & ~(RC65_BIT(RC65_SPH) | RC65_BIT(RC65_SPC) | \
+RC65_BIT(RC65_RTH) | RC65_BIT(RC65_RTC) | RC65_BIT(RC65_RTF)))
+
+/* Fields reported in combined hvac.zone triggers. Everything but the run times. */
+
+#define COMBINED_FIELDS (RC65_ALL & ~(RC65_BIT(RC65_RTH) | RC65_BIT(RC65_RTC) | RC65_BIT(RC65_RTF)))
+
+/*
+* Add the fields in mask to a message
+*/
+
+static void setZoneValues(xPL_MessagePtr msg, const rc65Status_t *st, unsigned mask)
+{
+	char wc[20];
+	Bool units = FALSE;
+	int f;
+
+	for(f = 0; f < RC65_FIELDS; f++){
+		if(!(mask & RC65_BIT(f)) || !rc65_format(wc, sizeof(wc), st, f))
+			continue;
+		xPL_setMessageNamedValue(msg, rc65_xpl_name(f), wc);
+		if((!units) && (rc65_kind(f) == RC65_KIND_Temp)){
+			xPL_setMessageNamedValue(msg, "units", temperatureUnits);
+			units = TRUE;
 		}
 	}
 }
 
 /*
-* Send a request for zone information
+* Send one hvac.zone trigger with every changed field of a zone
+*/
+
+static void sendCombinedTrigger(ZoneEntryPtr_t ze, const rc65Status_t *st, unsigned changed)
+{
+	if(!(changed &= st->present & COMBINED_FIELDS))
+		return;
+
+	xPL_clearMessageNamedValues(xplrcsZoneTriggerMessage);
+	xPL_setMessageNamedValue(xplrcsZoneTriggerMessage, "zone", ze->name);
+	setZoneValues(xplrcsZoneTriggerMessage, st, changed);
+	if(!xPL_sendMessage(xplrcsZoneTriggerMessage))
+		debug(DEBUG_UNEXPECTED, "Zone trigger message transmission failed");
+}
+
+/*
+* Combined trigger for a poll status change.
+* Changes for the same zone within the coalescing window are merged and sent together
+* when the window closes.
+*/
+
+static void queueCombinedTrigger(BusEventPtr_t ev)
+{
+	ZoneEntryPtr_t ze = ev->ze;
+
+	if(!coalesceWindow){
+		sendCombinedTrigger(ze, &ev->status, ev->changed);
+		return;
+	}
+
+	rc65_merge(&ze->trigStatus, &ev->status, ev->changed);
+	ze->trigChanged |= ev->changed;
+	if(!ze->trigDue){
+		ze->trigDue = monotonicMs() + coalesceWindow;
+		/* The window is the same for every zone, so the timer only needs arming for the first one */
+		if((!pendingTriggers++) && (!armTimer(triggerTimerFd, ze->trigDue)))
+			debug(DEBUG_UNEXPECTED, "Could not set trigger timer: %s", strerror(errno));
+	}
+}
+
+/*
+* Poll status change event handler.
+* Figure out which arguments changed since the last poll, and send triggers for them.
+*/
+
+static void doPollEvent(BusEventPtr_t ev)
+{
+	char wc[20];
+	const rc65Status_t *st = &ev->status;
+
+	if(combinedTriggers){
+		queueCombinedTrigger(ev);
+		return;
+	}
+
+	/* SPH has a dedicated trigger resource */
+	if(ev->changed & st->present & RC65_BIT(RC65_SPH)){
+		xPL_clearMessageNamedValues(xplrcsHeatSetPointTriggerMessage);
+		xPL_setMessageNamedValue(xplrcsHeatSetPointTriggerMessage, "zone", ev->ze->name);
+		xPL_setMessageNamedValue(xplrcsHeatSetPointTriggerMessage, "setpoint", rc65_xpl_name(RC65_SPH));
+		xPL_setMessageNamedValue(xplrcsHeatSetPointTriggerMessage, "temperature", 
+		rc65_format(wc, sizeof(wc), st, RC65_SPH));
+		xPL_setMessageNamedValue(xplrcsHeatSetPointTriggerMessage, "units", temperatureUnits); 
+	}
+
+	/* SPC has a dedicated trigger resource */
+	if(ev->changed & st->present & RC65_BIT(RC65_SPC)){
+		xPL_clearMessageNamedValues(xplrcsCoolSetPointTriggerMessage);
+		xPL_setMessageNamedValue(xplrcsCoolSetPointTriggerMessage, "zone", ev->ze->name);
+		xPL_setMessageNamedValue(xplrcsCoolSetPointTriggerMessage, "setpoint", rc65_xpl_name(RC65_SPC));
+		xPL_setMessageNamedValue(xplrcsCoolSetPointTriggerMessage, "temperature", 
+		rc65_format(wc, sizeof(wc), st, RC65_SPC));
+		xPL_setMessageNamedValue(xplrcsCoolSetPointTriggerMessage, "units", temperatureUnits); 
+	}
+
+	/* Zone triggers share a trigger resource */
+	xPL_clearMessageNamedValues(xplrcsZoneTriggerMessage);
+	xPL_setMessageNamedValue(xplrcsZoneTriggerMessage, "zone", ev->ze->name);
+	setZoneValues(xplrcsZoneTriggerMessage, st, ev->changed & ZONE_FIELDS);
+
+	if(ev->changed & st->present & RC65_BIT(RC65_SPC)){
+		if(!xPL_sendMessage(xplrcsCoolSetPointTriggerMessage))
+			debug(DEBUG_UNEXPECTED, "Cool Set point trigger message transmission failed");
+	}
+	if(ev->changed & st->present & RC65_BIT(RC65_SPH)){
+		if(!xPL_sendMessage(xplrcsHeatSetPointTriggerMessage))
+			debug(DEBUG_UNEXPECTED, "Heat Set point trigger message transmission failed");
+
+	}
+	if(ev->changed & st->present & ZONE_FIELDS){
+		if(!xPL_sendMessage(xplrcsZoneTriggerMessage))
+			debug(DEBUG_UNEXPECTED, "Zone trigger message transmission failed");
+	}
+
+}
+
+/*
+* Request response event handler.
+* Send a status message for the request the response belongs to.
+*/
+
+static void doResponseEvent(BusEventPtr_t ev)
+{
+	char wc[20];
+	rc65Field_t field;
+	const rc65Status_t *st = &ev->status;
+
+	/* If it was a set point request */
+	if((ev->cmdType == CMDTYPE_RQ_SETPOINT_HEAT)||(ev->cmdType == CMDTYPE_RQ_SETPOINT_COOL)){
+		/* Setpoint status (heat or cool) requested */
+		debug(DEBUG_EXPECTED,"Setpoint Status requested"); 
+		xPL_setSchema(xplrcsStatusMessage, "hvac", "setpoint");
+		xPL_clearMessageNamedValues(xplrcsStatusMessage);
+		xPL_setMessageNamedValue(xplrcsStatusMessage, "zone", 
+		(ev->ze && ev->ze->name) ? ev->ze->name : "unknown");
+
+		field = (ev->cmdType == CMDTYPE_RQ_SETPOINT_HEAT) ? RC65_SPH : RC65_SPC;
+		if(!rc65_format(wc, sizeof(wc), st, field))
+			return;
+		xPL_setMessageNamedValue(xplrcsStatusMessage, rc65_xpl_name(field), wc);
+		xPL_setMessageNamedValue(xplrcsStatusMessage, "units", temperatureUnits);
+		if(!xPL_sendMessage(xplrcsStatusMessage))
+			debug(DEBUG_UNEXPECTED, "Setpoint status transmission failed");
+	}
+	/* If it was a zone info request */
+	else if(ev->cmdType == CMDTYPE_RQ_ZONE){
+		debug(DEBUG_EXPECTED,"Zone Status requested"); 
+		xPL_setSchema(xplrcsStatusMessage, "hvac", "zone");
+		xPL_clearMessageNamedValues(xplrcsStatusMessage);
+		xPL_setMessageNamedValue(xplrcsStatusMessage, "zone",
+		(ev->ze && ev->ze->name) ? ev->ze->name : "unknown");
+		setZoneValues(xplrcsStatusMessage, st, st->present & ZONE_FIELDS);
+		if(!xPL_sendMessage(xplrcsStatusMessage))
+			debug(DEBUG_UNEXPECTED, "Zone info transmission failed");
+	} 
+	/* Heat or cool run times */
+	else if ((ev->cmdType == CMDTYPE_RQ_HEATTIME)||(ev->cmdType == CMDTYPE_RQ_COOLTIME)){
+		debug(DEBUG_EXPECTED,"Run time requested"); 
+		xPL_setSchema(xplrcsStatusMessage, "hvac", "runtime");
+		xPL_clearMessageNamedValues(xplrcsStatusMessage);
+		xPL_setMessageNamedValue(xplrcsStatusMessage, "zone", 
+		(ev->ze && ev->ze->name) ? ev->ze->name : "unknown");
+
+		field = (ev->cmdType == CMDTYPE_RQ_HEATTIME) ? RC65_RTH : RC65_RTC;
+		if(!rc65_format(wc, sizeof(wc), st, field))
+			return;
+		xPL_setMessageNamedValue(xplrcsStatusMessage, "state", rc65_xpl_name(field)); /* Heating or cooling */
+		xPL_setMessageNamedValue(xplrcsStatusMessage, "time", wc);
+		xPL_setMessageNamedValue(xplrcsStatusMessage, "units", "hours");
+			
+		if(!xPL_sendMessage(xplrcsStatusMessage))
+			debug(DEBUG_UNEXPECTED, "Setpoint status transmission failed");
+	}
+	/* Fan Time requested? */
+	else if (ev->cmdType == CMDTYPE_RQ_FANTIME){
+		debug(DEBUG_EXPECTED,"Fan time requested"); 
+
+		if(rc65_format(wc, sizeof(wc), st, RC65_RTF)){
+			xPL_setSchema(xplrcsStatusMessage, "hvac", "fantime");
+			xPL_clearMessageNamedValues(xplrcsStatusMessage);
+			xPL_setMessageNamedValue(xplrcsStatusMessage, "zone", 
+			(ev->ze && ev->ze->name) ? ev->ze->name : "unknown");
+			xPL_setMessageNamedValue(xplrcsStatusMessage, "state", rc65_xpl_name(RC65_RTF)); /* running */
+			xPL_setMessageNamedValue(xplrcsStatusMessage, "time", wc);
+			xPL_setMessageNamedValue(xplrcsStatusMessage, "units", "hours");
+			if(!xPL_sendMessage(xplrcsStatusMessage))
+				debug(DEBUG_UNEXPECTED, "Setpoint status transmission failed");
+		}
+	}
+		
+}
+
+/*
+* Gateway event handler.
+* Send an hvac.gateway trigger for a response timeout, a zone going offline or coming back online,
+* a command failed because its zone is offline, a command rejected because the bus is busy,
+* or a verification poll.
+*/
+
+static void doGatewayEvent(BusEventPtr_t ev)
+{
+	xPL_setSchema(xplrcsTriggerMessage, "hvac", "gateway");
+	xPL_clearMessageNamedValues(xplrcsTriggerMessage);
+	switch(ev->type){
+		case BUSEVENT_TIMEOUT:
+			xPL_setMessageNamedValue(xplrcsTriggerMessage, "event", "timeout");
+			break;
+
+		case BUSEVENT_OFFLINE:
+			xPL_setMessageNamedValue(xplrcsTriggerMessage, "event", "zone-offline");
+			break;
+
+		case BUSEVENT_ONLINE:
+			xPL_setMessageNamedValue(xplrcsTriggerMessage, "event", "zone-online");
+			break;
+
+		case BUSEVENT_VERIFIED:
+			xPL_setMessageNamedValue(xplrcsTriggerMessage, "event", 
+			(ev->changed) ? "command-reverted" : "command-confirmed");
+			break;
+
+		case BUSEVENT_BUSY:
+			xPL_setMessageNamedValue(xplrcsTriggerMessage, "event", "busy");
+			break;
+
+		default:
+			xPL_setMessageNamedValue(xplrcsTriggerMessage, "event", "command-failed");
+			break;
+	}
+	xPL_setMessageNamedValue(xplrcsTriggerMessage, "zone", ev->ze->name);
+	if((ev->type == BUSEVENT_TIMEOUT) || (ev->type == BUSEVENT_FAILED) || (ev->type == BUSEVENT_BUSY))
+		xPL_setMessageNamedValue(xplrcsTriggerMessage, "request", (ev->cmdType == CMDTYPE_NONE) ? "poll" : "command");
+	/* The values the thermostat has now. Only the ones which did not take if it was reverted. */
+	if(ev->type == BUSEVENT_VERIFIED)
+		setZoneValues(xplrcsTriggerMessage, &ev->status, (ev->changed) ? ev->changed : ev->checked);
+	if(!xPL_sendMessage(xplrcsTriggerMessage))
+		debug(DEBUG_UNEXPECTED, "Trigger gateway message transmission failed");
+}
+
+/*
+* Keep the status from a poll or zone request as the zone's status cache
+*/
+
+static void cacheStatus(BusEventPtr_t ev)
+{
+	if(!ev->ze)
+		return;
+	ev->ze->cache = ev->status;
+	ev->ze->cacheTime = monotonicMs();
+}
+
+/*
+* Act on an event from a bus. This always runs in the xPL thread.
+*/
+
+static void doBusEvent(BusEventPtr_t ev)
+{
+	switch(ev->type){
+		case BUSEVENT_POLL:
+			cacheStatus(ev);
+			if(ev->changed)
+				doPollEvent(ev);
+			break;
+
+		case BUSEVENT_RESPONSE:
+			if(ev->cmdType == CMDTYPE_RQ_ZONE)
+				cacheStatus(ev);
+			doResponseEvent(ev);
+			break;
+
+		case BUSEVENT_SENT: /* Read your writes */
+			if(ev->ze)
+				rc65_merge(&ev->ze->cache, &ev->status, ev->status.present);
+			break;
+
+		case BUSEVENT_VERIFIED: /* Roll back the values written which did not take */
+			if(ev->ze && ev->changed)
+				rc65_merge(&ev->ze->cache, &ev->status, ev->changed);
+			doGatewayEvent(ev);
+			break;
+
+		case BUSEVENT_TIMEOUT:
+		case BUSEVENT_OFFLINE:
+		case BUSEVENT_ONLINE:
+		case BUSEVENT_FAILED:
+		case BUSEVENT_BUSY:
+			doGatewayEvent(ev);
+			break;
+
+		default:
+			break;
+	}
+}
+
+/*
+* Pass an event from a bus to the xPL side.
+* In threaded mode, the event is copied into the bus event ring and the xPL thread is woken up,
+* otherwise it is acted on immediately.
+*/
+
+static void busEmit(BusEntryPtr_t bus, BusEventPtr_t ev)
+{
+	uint64_t one = 1;
+
+	if(!threadedMode){
+		doBusEvent(ev);
+		return;
+	}
+	if(!spsc_push(bus->evRing, ev)){
+		debug(DEBUG_UNEXPECTED, "Event ring full on bus %s, event dropped", bus->name);
+		return;
+	}
+	if(write(bus->evfd, &one, sizeof(one)) < 0)
+		debug(DEBUG_UNEXPECTED, "Could not wake xPL thread: %s", strerror(errno));
+}
+
+/*
+* Close the serial port on a bus, and arrange for it to be reopened later
+*/
+
+static void busDetach(BusEntryPtr_t bus)
+{
+	if(!threadedMode){
+		if(!xPL_removeIODevice(serio_fd(bus->serio))) /* Unregister ourself */
+			debug(DEBUG_UNEXPECTED,"Could not unregister from poll list");
+	}
+	serio_close(bus->serio); /* Close serial port */
+	bus->serio = NULL;
+	bus->serialRetryTimer = SERIAL_RETRY_TIME;
+
+	/* Abandon the transaction in progress */
+	if(bus->cmdPending){
+		freeCommand(bus, bus->cmdPending);
+		bus->cmdPending = NULL;
+	}
+	bus->pollPending = NULL;
+	memset(bus->trans, 0, sizeof(bus->trans));
+	bus->retry = FALSE;
+	bus->retryCount = 0;
+	bus->state = BUSSTATE_IDLE;
+}
+
+/*
+* Serial I/O processing for a bus.
+* Match each received line up with the poll or request it answers, and pass
+* the interesting ones on as bus events. Lines which do not answer an outstanding
+* poll or request are counted and dropped.
+*/
+
+static void busSerialReady(BusEntryPtr_t bus)
+{
+	unsigned lineLen;
+	String line;
+	unsigned changed, moved;
+	uint64_t now;
+	ZoneEntryPtr_t ze;
+	ZoneStatePtr_t zs;
+	CmdEntryPtr_t ce;
+	BusTransPtr_t t;
+	BusEvent_t ev;
+
+	/* Do non-blocking line reads until every buffered line has been handled */
+	while(bus->serio && (serio_nb_line_read(bus->serio) == TRUE)){
+
+		memset(&ev, 0, sizeof(ev));
+
+		/* Got a line or EOF */
+		if(serio_ateof(bus->serio)){
+			debug(DEBUG_EXPECTED, "EOF detected on serial port %s, closing port", bus->comPort);
+			busDetach(bus);
+			return; /* Bail */
+		}
+
+			
+		/* The line is a view into the serio receive buffer */
+		line = serio_line_view(bus->serio, &lineLen);
+		if(!lineLen) /* Ignore empty lines */
+			continue;
+
+		/* Decode the line, and find the transaction it answers */
+		rc65_decode(line, &ev.status);
+		t = &bus->trans[(ev.status.address < BUS_ADDRESSES) ? ev.status.address : 0];
+		if((ze = t->poll)){ /* If this pointer is non-null, we are expecting a poll response */
+			zs = ze->state;
+			
+			/* Has to be a response to a poll */
+			/* Compare with the last status reported */
+			now = monotonicMs();
+			if((changed = zone_poll_status(zs, &ev.status, fieldDeadband, fieldMinEmit, now, &moved)))
+				debug(DEBUG_STATUS, "Got updated poll status: %s", line);
+
+			/* Pass every poll on to refresh the status cache. Only the changed fields are reported. */
+			ev.type = BUSEVENT_POLL;
+			ev.cmdType = CMDTYPE_NONE;
+			ev.ze = ze;
+			ev.changed = changed;
+			busEmit(bus, &ev);
+			if(zs->expect.present)
+				busVerify(bus, ze, &ev.status);
+			
+			/* Done with poll, indicate that by setting pollPending to NULL */
+			t->poll = NULL;
+			if(bus->pollPending == ze)
+				bus->pollPending = NULL;
+			busEndTransaction(bus, now);
+			busZoneHeard(bus, ze);
+			busPollDone(bus, ze, moved ? TRUE : FALSE, now);
+	
+		} /* End if(t->poll) */
+		else if((ce = t->cmd)){  /* It's a response not related to a poll (i.e. a response from a request) */
+
+			debug(DEBUG_EXPECTED, "Non-poll response: %s", line);
+			
+			ev.type = BUSEVENT_RESPONSE;
+			ev.cmdType = ce->type;
+			ev.ze = ce->ze;
+			ev.changed = 0;
+			busEmit(bus, &ev);
+			busZoneHeard(bus, ce->ze);
+
+			/* Free the command entry */
+			t->cmd = NULL;
+			if(bus->cmdPending == ce)
+				bus->cmdPending = NULL;
+			freeCommand(bus, ce);
+			busEndTransaction(bus, monotonicMs());
+		}
+		else{ /* Nothing is waiting for this line */
+			debug(DEBUG_UNEXPECTED, "Stray line on bus %s dropped: %s", bus->name, line);
+			atomic_fetch_add_explicit(&bus->stray, 1, memory_order_relaxed);
+		}
+	} /* End serio_nb_line_read */
+
+	/* Start the next transaction if the bus is now free */
+	busKick(bus);
+}
+
+/*
+* Serial I/O handler (Callback from xPL)
 */
 
-static void doZoneResponse(String ws, ZoneEntryPtr_t ze)
+static void serioHandler(int fd, int revents, int userValue)
 {
+	BusEntryPtr_t bus = findBus(userValue);
 
-	if(!ze  || !ws)
-		return;
-	
-	sprintf(ws + strlen(ws), " R=1");
-	queueCommand( ze, ws, CMDTYPE_RQ_ZONE);
+	if(bus)
+		busSerialReady(bus);
 }
 
 /*
-* Send the time and date to the thermostat
+* Register a newly opened serial port with whatever is going to wait on it
 */
 
-
-static void doSetDateTime()
+static void busAttach(BusEntryPtr_t bus)
 {
-	time_t now;
-	struct tm ltime;
-	char ws[WS_SIZE];
-	static int count = 0;
-
-	time(&now);
-	localtime_r(&now, &ltime);
-
-	if(count >= 3600){
-		count = 0;
-		sprintf(ws, "TIME=%02d:%02d:%02d DATE=%02d/%02d/%02d DOW=%d", ltime.tm_hour, ltime.tm_min,
-		ltime.tm_sec, ltime.tm_mon + 1, ltime.tm_mday, ltime.tm_year % 100, (ltime.tm_wday + 1));
-		debug(DEBUG_ACTION, "Time update command: %s", ws);
-		queueCommand(NULL, ws, CMDTYPE_DATETIME);
+	/* In threaded mode, the bus thread polls the serial fd itself */
+	if(!threadedMode){
+		if(!xPL_addIODevice(serioHandler, bus->id, serio_fd(bus->serio), TRUE, FALSE, FALSE))
+			fatal("Could not register serial I/O fd with xPL");
 	}
-	else
-		count++;
-
 }
 
-
 /*
-* Our Listener 
+* Bus event handler (Callback from xPL in threaded mode)
+* Act on all of the events a bus thread has queued up.
 */
 
+static void busEventHandler(int fd, int revents, int userValue)
+{
+	uint64_t count;
+	BusEvent_t ev;
+	BusEntryPtr_t bus = findBus(userValue);
 
+	if(!bus)
+		return;
 
-static void xPLListener(xPL_MessagePtr theMessage, xPL_ObjectPtr userValue)
-{
+	if(read(bus->evfd, &count, sizeof(count)) < 0)
+		debug(DEBUG_UNEXPECTED, "Could not read event fd: %s", strerror(errno));
 
-	String ws, cmd = NULL;
-	ZoneEntryPtr_t ze = NULL;
+	while(spsc_pop(bus->evRing, &ev))
+		doBusEvent(&ev);
+}
 
 
-	if(!xPL_isBroadcastMessage(theMessage)){ /* If not a broadcast message */
-		if(xPL_MESSAGE_COMMAND == xPL_getMessageType(theMessage)){ /* If the message is a command */
-			const String iID = xPL_getTargetInstanceID(theMessage);
-			const String type = xPL_getSchemaType(theMessage);
-			const String class = xPL_getSchemaClass(theMessage);
-			const String command =  xPL_getMessageNamedValue(theMessage, "command");
-			const String request =  xPL_getMessageNamedValue(theMessage, "request");
-			const String  zone =  xPL_getMessageNamedValue(theMessage, "zone");
-			
-			/* Allocate a working string */
+/*
+* Per bus tick processing.
+* Housekeeping only. Traffic on the bus is sequenced by busKick().
+*/
 
-			if(!(ws = mallocz(WS_SIZE)))
-				MALLOC_ERROR;
-			ws[0] = 0;
-			
-			/* If a zone was specified, see if it is in the zone list, and get the zone entry */
-			if(zone){
-				debug(DEBUG_ACTION,"Zone present");
-				/* Find zone in list */
-				for(ze = zoneEntryHead; ze; ze = ze->next){
-					if(!strcmp(ze->name, zone))
-						break;
-				}
-				if(ze){
-					/* Copy the address into the working string */
-					debug(DEBUG_ACTION,"Zone entry found");
-					snprintf(ws, WS_SIZE, "A=%u", ze->address);
-				}
+static void busTick(BusEntryPtr_t bus)
+{
+	if(bus->serialRetryTimer){ /* If this is non-zero, we lost the serial connection, wait retry time and try again */
+		bus->serialRetryTimer--;
+		if(!bus->serialRetryTimer){
+			if(!(bus->serio = serio_open(bus->comPort, 9600))){
+				debug(DEBUG_UNEXPECTED,"Serial reconnect on %s failed, trying later...", bus->comPort);
+				bus->serialRetryTimer = SERIAL_RETRY_TIME;
+				return;
 			}
-			if(command)
-				debug(DEBUG_ACTION, "Command = %s", command);
-			if(request)
-				debug(DEBUG_ACTION, "Request = %s", request);
-
-			if((!strcmp(instanceID, iID)) && (!strcmp(class,"hvac"))){
-				if(!strcmp(type, "basic")){ /* Basic command schema */
-					if(command && ze){
-						switch(matchCommand(basicCommandList, command)){
-							case 0: /* hvac-mode */
-								cmd = doHVACMode(ws, theMessage, ze);
-								break;
-
-							case 1: /* fan-mode */
-								cmd = doFanMode(ws, theMessage, ze);
-								break;
-
-							case 2: /* setpoint */
-								cmd = doSetSetpoint(ws, theMessage, ze);
-								break;
-
-							case 3: /* display */
-								cmd = doDisplay(ws, theMessage, ze);
-								break;
-								
-							case 4: /* reset-runtime */
-								cmd = doResetRunTime(ws, theMessage, ze);
-								break;
-								
-							case 5: /* reset-fantime */
-								cmd = doResetFanTime(ws, theMessage, ze);
-								break;
-					
-							default:
-								break;
-						}
-					}
-					if(cmd){
-						queueCommand(ze, cmd, CMDTYPE_BASIC); /* Queue the command */
-					}
-					else{
-						debug(DEBUG_UNEXPECTED, "No command key in message");
-					}
-				}
-				else if(!strcmp(type, "request")){ /* Request command schema */
-					if(request){
-						switch(matchCommand(requestCommandList, request)){
-
-							case 0: /* gateinfo */
-								doGateInfo();
-								break;
-
-							case 1: /* zonelist */
-								doZoneList(ws);
-								break;
-
-							case 2: /* zoneinfo */
-								doZoneInfo( ws, ze );
-								break;
-
-							case 3: /* setpoint */
-								doGetSetPoint(ws, theMessage, ze);
-								break;
-
-							case 4: /* zone */
-								doZoneResponse(ws, ze);
-								break;
-								
-							case 5: /* runtime */
-								doGetRT(ws, theMessage, ze);
-								break;
-								
-							case 6: /* fantime */
-								doGetFT(ws, theMessage, ze);
-								break;
-
-							default:
-								break;
-						}								
-					}
-				}
+			else{
+				debug(DEBUG_EXPECTED,"Serial reconnect on %s successful", bus->comPort);
+				busAttach(bus);
+				busKick(bus);
 			}
-			free(ws);
 		}
-
 	}
 }
 
-
 /*
-* Serial I/O handler (Callback from xPL)
+* Bus timer handler (Callback from xPL)
 */
 
-static void serioHandler(int fd, int revents, int userValue)
+static void busTimerHandler(int fd, int revents, int userValue)
 {
-	char wc[20];
-	Bool sendZoneTrigger = FALSE;
-	Bool sendHeatSetPointTrigger = FALSE;
-	Bool sendCoolSetPointTrigger = FALSE;
-	int curArgc,lastArgc, sendAll = FALSE, i;
-	String line;
-	String pd,wscur,wslast,arg;
-	String val = NULL;
-	String curArgList[20];
-	String lastArgList[20];
-
-
-	/* Do non-blocking line read */
-	if(serio_nb_line_read(serioStuff)){
-		/* Got a line or EOF */
-		if(serio_ateof(serioStuff)){
-			debug(DEBUG_EXPECTED, "EOF detected on serial port, closing port");
-			if(!xPL_removeIODevice(serio_fd(serioStuff))) /* Unregister ourself */
-				debug(DEBUG_UNEXPECTED,"Could not unregister from poll list");
-			serio_close(serioStuff); /* Close serial port */
-			serioStuff = NULL;
-			serialRetryTimer = SERIAL_RETRY_TIME;
-			return; /* Bail */
-		}
+	uint64_t count;
+	BusEntryPtr_t bus = findBus(userValue);
 
-			
-		line = serio_line(serioStuff);
-		if(pollPending){ /* If this pointer is non-null, we are expecting a poll response */
-			
-			/* Has to be a response to a poll */
-			/* Compare with last line received */
-			if(!pollPending->first_time && strcmp(line, pollPending->last_poll)){
-				debug(DEBUG_STATUS, "Got updated poll status: %s", line);
-
-				/* Make working strings from the current and last lines */
-				if(!(wscur = strdup(line)))
-					MALLOC_ERROR;
-				if(!(wslast = strdup(pollPending->last_poll)))
-					MALLOC_ERROR;
+	if(!bus)
+		return;
 
-				/* Parse the current and last lists for comparison */
-	
-				curArgc = parseRC65Status(wscur, curArgList, 19);
-				lastArgc = parseRC65Status(wslast, lastArgList, 19);
+	if(read(bus->timerfd, &count, sizeof(count)) < 0)
+		debug(DEBUG_UNEXPECTED, "Could not read timer fd: %s", strerror(errno));
 
-				/* If arg list mismatch, set the sendAll flag */
-				if(lastArgc != curArgc){
-					sendAll = TRUE;
-				}
-				
-				/* Prep a zone trigger just in case something needs to be sent */
-				xPL_clearMessageNamedValues(xplrcsZoneTriggerMessage);
-				xPL_setMessageNamedValue(xplrcsZoneTriggerMessage, "zone", pollPending->name);
-				
-				/* Iterate through the list and figure out which args to send */
-				for(i = 0; i < curArgc; i++){
-					arg = curArgList[i];
-
-					/* If sendAll is set or args changed, then add the arg to the list of things to send */
-					if(sendAll || strcmp(curArgList[i], lastArgList[i])){
-						if(!(pd = strchr(arg, '='))){
-							debug(DEBUG_UNEXPECTED, "Parse error in %s point 1", arg);
-							sendAll = TRUE;
-							continue;
-						}
-						*pd = 0;
-						pd++;
-						if(!strcmp(arg, "SPH")){ /* SPH has a dedicated trigger resource */
-							sendHeatSetPointTrigger = TRUE;
-							xPL_clearMessageNamedValues(xplrcsHeatSetPointTriggerMessage);
-							xPL_setMessageNamedValue(xplrcsHeatSetPointTriggerMessage, "zone", pollPending->name);
-							xPL_setMessageNamedValue(xplrcsHeatSetPointTriggerMessage, "setpoint", setPointList[0]);
-							xPL_setMessageNamedValue(xplrcsHeatSetPointTriggerMessage, "temperature", pd );
-							xPL_setMessageNamedValue(xplrcsHeatSetPointTriggerMessage, "units", temperatureUnits); 
-						}
-
-						else if(!strcmp(arg, "SPC")){ /* SPC has a dedicated trigger resource */
-							sendCoolSetPointTrigger = TRUE;
-							xPL_clearMessageNamedValues(xplrcsCoolSetPointTriggerMessage);
-							xPL_setMessageNamedValue(xplrcsCoolSetPointTriggerMessage, "zone", pollPending->name);
-							xPL_setMessageNamedValue(xplrcsCoolSetPointTriggerMessage, "setpoint", setPointList[1]);
-							xPL_setMessageNamedValue(xplrcsCoolSetPointTriggerMessage, "temperature", pd );
-							xPL_setMessageNamedValue(xplrcsCoolSetPointTriggerMessage, "units", temperatureUnits); 
-						}
-						else if(!strcmp(arg, "FM")){ /* Zone triggers share a trigger resource */
-							sendZoneTrigger = TRUE;
-	
+	busKick(bus);
+}
 
-							if(!strcmp(pd, "0"))
-								val = fanModeList[0];
-							else
-								val = fanModeList[1];
-							xPL_setMessageNamedValue(xplrcsZoneTriggerMessage, "fan-mode", val);
-						}
-						else if(!strcmp(arg, "M")){
-							sendZoneTrigger = TRUE;
-							if(!strcmp(pd, "O"))
-								val = modeList[0];
-							else if(!strcmp(pd, "H"))
-								val = modeList[1];
-							else if(!strcmp(pd, "C"))
-								val = modeList[2];
-							else if(!strcmp(pd, "A"))
-								val = modeList[3];
-							else
-								val = "?";
-							xPL_setMessageNamedValue(xplrcsZoneTriggerMessage,"hvac-mode", val);
-						}
-						else if(!strcmp(arg, "T")){
-							sendZoneTrigger = TRUE;
-							xPL_setMessageNamedValue(xplrcsZoneTriggerMessage,"temperature", pd);
-							xPL_setMessageNamedValue(xplrcsZoneTriggerMessage,"units", temperatureUnits);
-						}
-					} /* End if */
-
-
-				} /* End for */
-				if(sendCoolSetPointTrigger){
-					if(!xPL_sendMessage(xplrcsCoolSetPointTriggerMessage))
-						debug(DEBUG_UNEXPECTED, "Cool Set point trigger message transmission failed");
-				}
-				if(sendHeatSetPointTrigger){
-					if(!xPL_sendMessage(xplrcsHeatSetPointTriggerMessage))
-						debug(DEBUG_UNEXPECTED, "Heat Set point trigger message transmission failed");
+/*
+* Trigger timer handler (Callback from xPL)
+* Send the combined triggers whose coalescing window has closed.
+*/
 
-				}
-				if(sendZoneTrigger){
-					if(!xPL_sendMessage(xplrcsZoneTriggerMessage))
-						debug(DEBUG_UNEXPECTED, "Zone trigger message transmission failed");
-				}
+static void triggerTimerHandler(int fd, int revents, int userValue)
+{
+	unsigned i;
+	uint64_t count, now, next = 0;
+	BusEntryPtr_t bus;
+	ZoneEntryPtr_t ze;
 
+	if(read(triggerTimerFd, &count, sizeof(count)) < 0)
+		debug(DEBUG_UNEXPECTED, "Could not read timer fd: %s", strerror(errno));
+
+	now = monotonicMs();
+	for(bus = busEntryHead; bus; bus = bus->next){
+		for(i = 0, ze = bus->zones; i < bus->numZones; i++, ze++){
+			if(!ze->trigDue)
+				continue;
+			if(ze->trigDue <= now){
+				sendCombinedTrigger(ze, &ze->trigStatus, ze->trigChanged);
+				ze->trigChanged = 0;
+				ze->trigDue = 0;
+				pendingTriggers--;
+			}
+			else if((!next) || (ze->trigDue < next))
+				next = ze->trigDue;
+		}
+	}
 
-				/* Free working strings */
-				free(wscur);
-				free(wslast);
+	if((next) && (!armTimer(triggerTimerFd, next)))
+		debug(DEBUG_UNEXPECTED, "Could not set trigger timer: %s", strerror(errno));
+}
 
-				
-			}
-			/* Copy current string into last poll for future comparisons */	
-			confreadStringCopy(pollPending->last_poll, line, WS_SIZE);
-			
-			/* Clear the first time flag */
-			
-			pollPending->first_time = FALSE;
-			
-			/* Done with poll, indicate that by setting pollPending to NULL */
-			pollPending = NULL;
-	
-		} /* End if(pollPending) */
-		else{  /* It's a response not related to a poll (i.e. a response from a request) */
+/*
+* Bus thread (threaded mode only)
+* Owns the serial port, command queue and poll scheduler for one bus. Commands arrive
+* through the command ring, and serial input, the bus timer and the one second tick are
+* handled here instead of in the xPL thread.
+*/
 
-			if(!(wscur = strdup(line)))
-				MALLOC_ERROR;
+static void *busThread(void *arg)
+{
+	BusEntryPtr_t bus = arg;
+	BusCmd_t bc;
+	struct pollfd pfd[3];
+	struct timespec now, nextTick;
+	uint64_t count;
+	int timeout;
+	sigset_t sigs;
+
+	/* Leave the shutdown signals to the xPL thread */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &nextTick);
+	nextTick.tv_sec++;
+
+	for(;;){
+		/* Wait for a command, serial input, the bus timer, or the next tick */
+		pfd[0].fd = bus->cmdfd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = serio_fd(bus->serio); /* -1 (ignored) when the port is closed */
+		pfd[1].events = POLLIN;
+		pfd[2].fd = bus->timerfd;
+		pfd[2].events = POLLIN;
+		pfd[0].revents = pfd[1].revents = pfd[2].revents = 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timeout = (nextTick.tv_sec - now.tv_sec) * 1000 + (nextTick.tv_nsec - now.tv_nsec) / 1000000;
+		if(timeout < 0)
+			timeout = 0;
+
+		if(poll(pfd, 3, timeout) < 0){
+			if(errno != EINTR)
+				debug(DEBUG_UNEXPECTED, "Poll error on bus %s: %s", bus->name, strerror(errno));
+			continue;
+		}
 
-			debug(DEBUG_EXPECTED, "Non-poll response: %s", wscur);
-			
-			/* Parse the returned arguments */
-			curArgc = parseRC65Status(wscur, curArgList, 19);
-			/* If it was a set point request */
-			if(cmdEntryTail){
-				if((cmdEntryTail->type == CMDTYPE_RQ_SETPOINT_HEAT)||(cmdEntryTail->type == CMDTYPE_RQ_SETPOINT_COOL)){
-					/* Setpoint status (heat or cool) requested */
-					debug(DEBUG_EXPECTED,"Setpoint Status requested"); 
-					xPL_setSchema(xplrcsStatusMessage, "hvac", "setpoint");
-					xPL_clearMessageNamedValues(xplrcsStatusMessage);
-					xPL_setMessageNamedValue(xplrcsStatusMessage, "zone", 
-					(cmdEntryTail->ze && cmdEntryTail->ze->name) ? cmdEntryTail->ze->name : "unknown");
-
-					if(cmdEntryTail->type == CMDTYPE_RQ_SETPOINT_HEAT){
-						/* Setpoint heat requested */
-						val = getVal(wc, sizeof(wc), curArgList, "SPH");
-						if(val)
-							xPL_setMessageNamedValue(xplrcsStatusMessage, setPointList[0], val );
-					}
-					else{
-						val = getVal(wc, sizeof(wc), curArgList, "SPC");
-						if(val)
-							xPL_setMessageNamedValue(xplrcsStatusMessage, setPointList[1], val );
-					}
-					if(val)
-						xPL_setMessageNamedValue(xplrcsStatusMessage, "units", temperatureUnits);
-					if(val && !xPL_sendMessage(xplrcsStatusMessage))
-						debug(DEBUG_UNEXPECTED, "Setpoint status transmission failed");
-				}
-				/* If it was a zone info request */
-				else if(cmdEntryTail->type == CMDTYPE_RQ_ZONE){
-					char wc[20];
-					debug(DEBUG_EXPECTED,"Zone Status requested"); 
-					xPL_setSchema(xplrcsStatusMessage, "hvac", "zone");
-					xPL_clearMessageNamedValues(xplrcsStatusMessage);
-					for(i = 0 ; curArgList[i]; i++){ /* Iterate through arg list */
-						debug(DEBUG_ACTION, "Arg: %s", curArgList[i]);
-						if(!strncmp(curArgList[i], "O=", 2))
-							xPL_setMessageNamedValue(xplrcsStatusMessage, "zone",
-							(cmdEntryTail->ze && cmdEntryTail->ze->name) ? cmdEntryTail->ze->name : "unknown");
-						else if(!strncmp(curArgList[i], "FM=", 3)){
-							val = getVal(wc, sizeof(wc), curArgList, "FM");
-							if(val){
-								if(!strcmp(val, "0"))
-									val = fanModeList[0];
-								else
-									val = fanModeList[1];
-								xPL_setMessageNamedValue(xplrcsStatusMessage,"fan-mode", val);
-							}
-						}
-						else if(!strncmp(curArgList[i], "M=", 2)){
-							val = getVal(wc, sizeof(wc), curArgList, "M");
-							if(val){
-								if(!strcmp(val, "O"))
-									val = modeList[0];
-								else if(!strcmp(val, "H"))
-									val = modeList[1];
-								else if(!strcmp(val, "C"))
-									val = modeList[2];
-								else if(!strcmp(val, "A"))
-									val = modeList[3];
-								else
-									val = "?";
-								xPL_setMessageNamedValue(xplrcsStatusMessage,"hvac-mode", val);
-							}
-						}
-						else if(!strncmp(curArgList[i], "T=", 2)){
-							val = getVal(wc, sizeof(wc), curArgList, "T");
-							if(val){
-								xPL_setMessageNamedValue(xplrcsStatusMessage,"temperature", val);
-								xPL_setMessageNamedValue(xplrcsStatusMessage, "units", temperatureUnits);
-							}
-
-						}
+		if(pfd[0].revents){
+			if(read(bus->cmdfd, &count, sizeof(count)) < 0)
+				debug(DEBUG_UNEXPECTED, "Could not read command fd: %s", strerror(errno));
+			while(spsc_pop(bus->cmdRing, &bc))
+				queueCommand(bus, bc.ze, bc.cmd, bc.type, bc.queued);
+			busKick(bus);
+		}
 
-					}
-					if(!xPL_sendMessage(xplrcsStatusMessage))
-						debug(DEBUG_UNEXPECTED, "Zone info transmission failed");
-				} 
-				/* Heat or cool run times */
-				else if ((cmdEntryTail->type == CMDTYPE_RQ_HEATTIME)||(cmdEntryTail->type == CMDTYPE_RQ_COOLTIME)){
-					debug(DEBUG_EXPECTED,"Run time requested"); 
-					xPL_setSchema(xplrcsStatusMessage, "hvac", "runtime");
-					xPL_clearMessageNamedValues(xplrcsStatusMessage);
-					xPL_setMessageNamedValue(xplrcsStatusMessage, "zone", 
-					(cmdEntryTail->ze && cmdEntryTail->ze->name) ? cmdEntryTail->ze->name : "unknown");
-
-					if(cmdEntryTail->type == CMDTYPE_RQ_HEATTIME){
-						/* Setpoint heat requested */
-						val = getVal(wc, sizeof(wc), curArgList, "RTH");
-						xPL_setMessageNamedValue(xplrcsStatusMessage, "state", setPointList[0]); /* Heating */
-					}
-					else{
-						val = getVal(wc, sizeof(wc), curArgList, "RTC");
-						xPL_setMessageNamedValue(xplrcsStatusMessage, "state", setPointList[1]); /* Cooling */
-					}
-					if(val){
-						xPL_setMessageNamedValue(xplrcsStatusMessage, "time", val);
-						xPL_setMessageNamedValue(xplrcsStatusMessage, "units", "hours");
-						
-						if(!xPL_sendMessage(xplrcsStatusMessage))
-							debug(DEBUG_UNEXPECTED, "Setpoint status transmission failed");
-					
-					}
-					
-				}
-				/* Fan Time requested? */
-				else if (cmdEntryTail->type == CMDTYPE_RQ_FANTIME){
-					debug(DEBUG_EXPECTED,"Fan time requested"); 
+		if(pfd[1].revents)
+			busSerialReady(bus);
 
+		if(pfd[2].revents){
+			if(read(bus->timerfd, &count, sizeof(count)) < 0)
+				debug(DEBUG_UNEXPECTED, "Could not read timer fd: %s", strerror(errno));
+			busKick(bus);
+		}
 
-			
-					val = getVal(wc, sizeof(wc), curArgList, "RTF");
-					if(val){
-						xPL_setSchema(xplrcsStatusMessage, "hvac", "fantime");
-						xPL_clearMessageNamedValues(xplrcsStatusMessage);
-						xPL_setMessageNamedValue(xplrcsStatusMessage, "zone", 
-						(cmdEntryTail->ze && cmdEntryTail->ze->name) ? cmdEntryTail->ze->name : "unknown");
-						xPL_setMessageNamedValue(xplrcsStatusMessage, "state", fanStateList[0]); /* running */
-						xPL_setMessageNamedValue(xplrcsStatusMessage, "time", val);
-						xPL_setMessageNamedValue(xplrcsStatusMessage, "units", "hours");
-						if(!xPL_sendMessage(xplrcsStatusMessage))
-							debug(DEBUG_UNEXPECTED, "Setpoint status transmission failed");
-					
-					}
-					
-				}
-					
-			}
-			/* Free the command entry */
-			dequeueAndFreeCommand();
-			 /* Free working string */
-			free(wscur);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if((now.tv_sec > nextTick.tv_sec) || ((now.tv_sec == nextTick.tv_sec) && (now.tv_nsec >= nextTick.tv_nsec))){
+			nextTick.tv_sec++;
+			busTick(bus);
 		}
-	} /* End serio_nb_line_read */
+	}
+	return NULL;
 }
 
-
 /*
 * Our tick handler. 
-* This is used to synchonize the sending of data to the RCS thermostat.
+* This sends the ready trigger, and gives each bus its tick.
 */
 
 static void tickHandler(int userVal, xPL_ObjectPtr obj)
 {
-	static short pollCtr = 0;
 	static short readySent = FALSE;
-	static ZoneEntryPtr_t pollZone = NULL;
-	
-	
-
-	
-
+	static unsigned tickCtr = 0;
+	BusEntryPtr_t bus;
 
-	pollCtr++;
+	tickCtr++;
 
-	debug(DEBUG_STATUS, "TICK: %d", pollCtr);
+	debug(DEBUG_STATUS, "TICK: %u", tickCtr);
 	/* Process clock tick update checking */
-	
-	if(serialRetryTimer){ /* If this is non-zero, we lost the serial connection, wait retry time and try again */
-		serialRetryTimer--;
-		if(!serialRetryTimer){
-			if(!(serioStuff = serio_open(comPort, 9600))){
-				debug(DEBUG_UNEXPECTED,"Serial reconnect failed, trying later...");
-				serialRetryTimer = SERIAL_RETRY_TIME;
-				return;
-			}
-			else{
-				debug(DEBUG_EXPECTED,"Serial reconnect successful");
-				if(!xPL_addIODevice(serioHandler, 1234, serio_fd(serioStuff), TRUE, FALSE, FALSE))
-					fatal("Could not register serial I/O fd with xPL");
-			}
-		}
-	}
 				
 	doSetDateTime();
 
@@ -1470,39 +2888,118 @@ static void tickHandler(int userVal, xPL_ObjectPtr obj)
 		xPL_setMessageNamedValue(xplrcsTriggerMessage, "event", "ready");
 		if(!xPL_sendMessage(xplrcsTriggerMessage))
 			debug(DEBUG_UNEXPECTED, "Trigger event ready message transmission failed");
+		return;
+	}
 
+	/* Each bus is scheduled independently. In threaded mode, the bus threads do their own ticks. */
+	if(!threadedMode){
+		for(bus = busEntryHead; bus; bus = bus->next)
+			busTick(bus);
 	}
-	else if(cmdEntryTail && (!cmdEntryTail->sent)){ /* If command pending */
-		/* Uppercase the command string */
-		str2Upper(cmdEntryTail->cmd);
-		debug(DEBUG_EXPECTED, "Sending command: %s", cmdEntryTail->cmd);
-		serio_printf(serioStuff, "%s\r", cmdEntryTail->cmd);
-		cmdEntryTail->sent = TRUE;
-		if((cmdEntryTail->type == CMDTYPE_DATETIME)||(cmdEntryTail->type == CMDTYPE_BASIC)||
-		(cmdEntryTail->type == CMDTYPE_NONE))
-			dequeueAndFreeCommand(); /* These commands do not send back a response */
-	}
-
-	else if(pollCtr >= pollRate){ /* Else check poll counter */
-		pollCtr = 0;
-		/* Ensure pollZone is not NULL */
-		if(!pollZone)
-			pollZone = zoneEntryHead;
-		if(pollZone){
-			debug(DEBUG_ACTION, "Polling Status A=%d, R=1...", pollZone->address);
-			serio_printf(serioStuff, "A=%d R=1\r", pollZone->address);
-			if(pollPending){
-				/* Note: This probably warrants a trigger message of some sort */
-				debug(DEBUG_UNEXPECTED, "Did not receive a response from zone %s at address %u", 
-				pollPending->name, pollPending->address);
-			}
-			pollPending = pollZone; /* Set to current poll entry */
-			pollZone = pollZone->next;
-		}
-	}		
 }
 
 
+/*
+* Create a bus with the zones listed in a comma separated zone list, and add it to the bus list
+*/
+
+static BusEntryPtr_t addBus(const String name, const String port, const String zones, unsigned rate, unsigned gap,
+unsigned depth)
+{
+	int i, j, n;
+	String za;
+	String plist[BUS_ADDRESSES];
+	uint32_t used[BUS_ADDRESSES / 32] = {0}; /* Addresses taken on this bus */
+	BusEntryPtr_t bus, b;
+	ZoneEntryPtr_t ze;
+
+	/* Initialize bus entry */
+	if(!(bus = mallocz(sizeof(BusEntry_t))))
+		MALLOC_ERROR;
+	if(!(bus->name = strdup(name)))
+		MALLOC_ERROR;
+	if(!(bus->comPort = strdup(port)))
+		MALLOC_ERROR;
+	bus->pollRate = rate;
+	bus->gap = gap;
+	bus->queueDepth = depth;
+	bus->id = numBuses;
+
+	for(b = busEntryHead; b; b = b->next){
+		if(!strcmp(b->comPort, bus->comPort))
+			fatal("Bus %s uses com port %s which is already used by bus %s", bus->name, bus->comPort, b->name);
+	}
+
+	/* Split the zones, there can be one per thermostat address */
+	n = dupOrSplitString(zones, plist, ',', BUS_ADDRESSES - 1);
+	if(n > BUS_ADDRESSES - 1)
+		fatal("Bus %s has more than %d zones", bus->name, BUS_ADDRESSES - 1);
+	if(!(bus->zones = mallocz(n * sizeof(ZoneEntry_t))))
+		MALLOC_ERROR;
+	if(!(bus->sched = mallocz(n * sizeof(ZoneSched_t))))
+		MALLOC_ERROR;
+	if(!(bus->zoneState = mallocz(n * sizeof(ZoneState_t))))
+		MALLOC_ERROR;
+	
+	for(i = 0; i < n; i++){
+		if(!confreadFindSection(configEntry, plist[i]))
+			fatal("Zone section %s is missing in config file", plist[i]);
+		if(findZone(plist[i]))
+			fatal("Zone %s is listed more than once", plist[i]);
+		
+		/* Initialize zone entry */	
+		ze = &bus->zones[i];
+		ze->sched = &bus->sched[i];
+		ze->state = &bus->zoneState[i];
+		if(!(ze->name = strdup(plist[i])))
+			MALLOC_ERROR;
+		if(!(za = confreadValueBySectKey(configEntry, plist[i], "address")))
+			fatal("Zone section %s is missing an address key", ze->name);
+		if(!str2uns(za, &ze->address, 1, 255))
+			fatal("Zone section %s has an out of range address", ze->name);
+		if(used[ze->address / 32] & (1U << (ze->address % 32))){
+			for(j = 0; bus->zones[j].address != ze->address; j++);
+			fatal("Zones %s and %s on bus %s have the same address", bus->zones[j].name, ze->name, bus->name);
+		}
+		used[ze->address / 32] |= 1U << (ze->address % 32);
+		ze->state->pollMin = rate;
+		if((za = confreadValueBySectKey(configEntry, plist[i], "min-poll-interval"))){
+			if(!str2uns(za, &ze->state->pollMin, POLL_RATE_MIN, POLL_INTERVAL_MAX))
+				fatal("Minimum poll interval in zone section %s must be between %d and %d seconds", ze->name,
+				POLL_RATE_MIN, POLL_INTERVAL_MAX);
+		}
+		ze->state->pollMax = (ze->state->pollMin > POLL_INTERVAL_MAX_DEF) ? ze->state->pollMin : POLL_INTERVAL_MAX_DEF;
+		if((za = confreadValueBySectKey(configEntry, plist[i], "max-poll-interval"))){
+			if(!str2uns(za, &ze->state->pollMax, ze->state->pollMin, POLL_INTERVAL_MAX))
+				fatal("Maximum poll interval in zone section %s must be between %d and %d seconds", ze->name,
+				ze->state->pollMin, POLL_INTERVAL_MAX);
+		}
+		ze->queueDepth = zoneQueueDepth;
+		if((za = confreadValueBySectKey(configEntry, plist[i], "queue-depth"))){
+			if(!str2uns(za, &ze->queueDepth, 1, QUEUE_SIZE_MAX))
+				fatal("Queue depth in zone section %s must be between 1 and %d commands", ze->name, QUEUE_SIZE_MAX);
+		}
+		ze->state->pollMin *= 1000;
+		ze->state->pollMax *= 1000;
+		ze->state->pollInterval = ze->state->pollMin;
+		ze->state->first_time = TRUE;
+		ze->bus = bus;
+		registerZone(ze);
+	}
+	free(plist[0]);
+	bus->numZones = n;
+	
+	/* Insert into bus list */
+	if(!busEntryHead)
+		busEntryHead = busEntryTail = bus;
+	else
+		busEntryTail = busEntryTail->next = bus;
+	numBuses++;
+
+	debug(DEBUG_ACTION, "Bus %s on %s has %d zones", bus->name, bus->comPort, n);
+	return bus;
+}
+
 /*
 * Show help
 */
@@ -1544,9 +3041,11 @@ int main(int argc, char *argv[])
 	int longindex;
 	int optchar;
 	int i;
+	unsigned minEmit;
+	uint64_t start;
 	String p;
-	String plist[MAX_ZONES];
-	ZoneEntryPtr_t ze;
+	SectionEntryPtr_t se;
+	BusEntryPtr_t bus;
 
 		
 
@@ -1672,44 +3171,6 @@ int main(int argc, char *argv[])
 		
 	/* Get config file entries in general section */
 	
-	/* zones (mandatory) */
-	if((!(p = confreadValueBySectKey(configEntry, "general", "zones"))) || (!strlen(p)))
-		fatal("At least one zone must be defined in %s", configFile);
-		
-	/* Split the zones */
-	numZones = dupOrSplitString(p, plist, ',', MAX_ZONES);
-	
-	for(i = 0; i < numZones; i++){
-		String za;
-		if(!confreadFindSection(configEntry, plist[i]))
-			fatal("Zone section %s is missing in config file", plist[i]);
-		
-		/* Initialize zone entry */	
-		if(!(ze = mallocz(sizeof(ZoneEntry_t))))
-			MALLOC_ERROR;
-		if(!(ze->last_poll = mallocz(WS_SIZE)))
-			MALLOC_ERROR;
-		if(!(ze->name = strdup(plist[i])))
-			MALLOC_ERROR;
-		if(!(za = confreadValueBySectKey(configEntry, plist[i], "address")))
-			fatal("Zone section %s is missing an address key", ze->name);
-		if(!str2uns(za, &ze->address, 1, 255))
-			fatal("Zone section %s has an out of range address", ze->name);
-		ze->first_time = TRUE;
-		
-		/* Insert into zone list */
-		if(!zoneEntryHead)
-			zoneEntryHead = zoneEntryTail = ze;
-		else{
-			zoneEntryTail->next = ze;
-			ze->prev = zoneEntryTail;
-			zoneEntryTail = ze;
-		}		
-	}
-	free(plist[0]);
-	debug(DEBUG_ACTION, "Number of zones defined: %d\n", numZones);
-		
-	
 	/* com port */
 	if((!clOverride.com_port) && (p = confreadValueBySectKey(configEntry, "general", "com-port")))
 		confreadStringCopy(comPort, p, sizeof(comPort));
@@ -1735,12 +3196,188 @@ int main(int argc, char *argv[])
 		if(!str2uns(p, &pollRate, POLL_RATE_MIN, POLL_RATE_MAX))
 			fatal("Poll Rate must be between %d and %d seconds", POLL_RATE_MIN, POLL_RATE_MAX);
 	}
+	/* inter-frame gap */
+	if((p = confreadValueBySectKey(configEntry, "general", "inter-frame-gap"))){
+		if(!str2uns(p, &interFrameGap, 0, INTER_FRAME_GAP_MAX))
+			fatal("Inter-frame gap must be between 0 and %d milliseconds", INTER_FRAME_GAP_MAX);
+	}
 	/* units */
 	if(((!clOverride.poll_rate) && (p = confreadValueBySectKey(configEntry, "general", "units")))){
 		confreadStringCopy(temperatureUnits, p, sizeof(temperatureUnits));
 		if((strcmp(temperatureUnits, "celsius")) && (strcmp(temperatureUnits, "fahrenheit")))
 			fatal("Units must be either celsius or fahrenheit");
 	}
+
+	/* Command queue size */
+	if((p = confreadValueBySectKey(configEntry, "general", "queue-size"))){
+		if(!str2uns(p, &queueSize, QUEUE_SIZE_MIN, QUEUE_SIZE_MAX))
+			fatal("Queue size must be between %d and %d commands", QUEUE_SIZE_MIN, QUEUE_SIZE_MAX);
+	}
+
+	/* Queue depth limits, leaving a pool entry for the command in progress */
+	queueDepth = (queueDepth >= queueSize) ? queueSize - 1 : queueDepth;
+	if((p = confreadValueBySectKey(configEntry, "general", "queue-depth"))){
+		if(!str2uns(p, &queueDepth, 1, queueSize - 1))
+			fatal("Queue depth must be between 1 and %d commands", queueSize - 1);
+	}
+	if((p = confreadValueBySectKey(configEntry, "general", "zone-queue-depth"))){
+		if(!str2uns(p, &zoneQueueDepth, 1, QUEUE_SIZE_MAX))
+			fatal("Zone queue depth must be between 1 and %d commands", QUEUE_SIZE_MAX);
+	}
+
+	/* Buses defined in their own sections */
+	for(se = confreadGetFirstSection(configEntry); se; se = confreadGetNextSection(se)){
+		String busSect = confreadGetSection(se);
+		String zones, port;
+		unsigned busPollRate = pollRate;
+		unsigned busGap = interFrameGap;
+		unsigned busDepth = queueDepth;
+
+		if(!busSect || strncmp(busSect, BUS_SECTION_PREFIX, strlen(BUS_SECTION_PREFIX)))
+			continue;
+		if((!(port = confreadValueBySectKey(configEntry, busSect, "com-port"))) || (!strlen(port)))
+			fatal("Bus section %s is missing a com-port key", busSect);
+		if((!(zones = confreadValueBySectKey(configEntry, busSect, "zones"))) || (!strlen(zones)))
+			fatal("At least one zone must be defined in bus section %s", busSect);
+		if((p = confreadValueBySectKey(configEntry, busSect, "poll-rate"))){
+			if(!str2uns(p, &busPollRate, POLL_RATE_MIN, POLL_RATE_MAX))
+				fatal("Poll Rate in bus section %s must be between %d and %d seconds", busSect, 
+				POLL_RATE_MIN, POLL_RATE_MAX);
+		}
+		if((p = confreadValueBySectKey(configEntry, busSect, "inter-frame-gap"))){
+			if(!str2uns(p, &busGap, 0, INTER_FRAME_GAP_MAX))
+				fatal("Inter-frame gap in bus section %s must be between 0 and %d milliseconds", busSect, 
+				INTER_FRAME_GAP_MAX);
+		}
+		if((p = confreadValueBySectKey(configEntry, busSect, "queue-depth"))){
+			if(!str2uns(p, &busDepth, 1, queueSize - 1))
+				fatal("Queue depth in bus section %s must be between 1 and %d commands", busSect, queueSize - 1);
+		}
+		addBus(busSect + strlen(BUS_SECTION_PREFIX), port, zones, busPollRate, busGap, busDepth);
+	}
+
+	/* Zones in the general section are on the general com port */
+	if((p = confreadValueBySectKey(configEntry, "general", "zones")) && (strlen(p)))
+		addBus("general", comPort, p, pollRate, interFrameGap, queueDepth);
+	
+	if(!numBuses)
+		fatal("At least one zone must be defined in %s", configFile);
+
+	/* Poll budget */
+	if((p = confreadValueBySectKey(configEntry, "general", "poll-budget"))){
+		if(!str2uns(p, &pollBudget, 1, 100))
+			fatal("Poll budget must be between 1 and 100 percent");
+	}
+
+	/* Dead zone detection */
+	if((p = confreadValueBySectKey(configEntry, "general", "dead-after"))){
+		if(!str2uns(p, &deadAfter, 1, 100))
+			fatal("Dead after must be between 1 and 100 missed responses");
+	}
+	if((p = confreadValueBySectKey(configEntry, "general", "probe-interval"))){
+		if(!str2uns(p, &probeMin, POLL_RATE_MIN, POLL_INTERVAL_MAX))
+			fatal("Probe interval must be between %d and %d seconds", POLL_RATE_MIN, POLL_INTERVAL_MAX);
+		probeMin *= 1000;
+	}
+	if((p = confreadValueBySectKey(configEntry, "general", "probe-interval-max"))){
+		if(!str2uns(p, &probeMax, probeMin / 1000, PROBE_INTERVAL_MAX))
+			fatal("Maximum probe interval must be between %d and %d seconds", probeMin / 1000, PROBE_INTERVAL_MAX);
+		probeMax *= 1000;
+	}
+	else if(probeMax < probeMin)
+		probeMax = probeMin;
+
+	/* Response timeouts */
+	if((p = confreadValueBySectKey(configEntry, "general", "poll-timeout"))){
+		if(!str2uns(p, &pollTimeout, RESPONSE_TIMEOUT_MIN, RESPONSE_TIMEOUT_MAX))
+			fatal("Poll timeout must be between %d and %d milliseconds", RESPONSE_TIMEOUT_MIN, RESPONSE_TIMEOUT_MAX);
+	}
+	if((p = confreadValueBySectKey(configEntry, "general", "command-timeout"))){
+		if(!str2uns(p, &commandTimeout, RESPONSE_TIMEOUT_MIN, RESPONSE_TIMEOUT_MAX))
+			fatal("Command timeout must be between %d and %d milliseconds", RESPONSE_TIMEOUT_MIN, RESPONSE_TIMEOUT_MAX);
+	}
+	if((p = confreadValueBySectKey(configEntry, "general", "timeout-action"))){
+		if(!strcmp(p, "skip"))
+			timeoutAction = TIMEOUT_SKIP;
+		else if(!strcmp(p, "retry"))
+			timeoutAction = TIMEOUT_RETRY;
+		else if(!strcmp(p, "trigger"))
+			timeoutAction = TIMEOUT_TRIGGER;
+		else
+			fatal("Timeout action must be one of skip, retry or trigger");
+	}
+	if((p = confreadValueBySectKey(configEntry, "general", "timeout-retries"))){
+		if(!str2uns(p, &timeoutRetries, 1, TIMEOUT_RETRIES_MAX))
+			fatal("Timeout retries must be between 1 and %d", TIMEOUT_RETRIES_MAX);
+	}
+
+	/* Maximum frame length for coalesced basic commands */
+	if((p = confreadValueBySectKey(configEntry, "general", "max-frame-length"))){
+		if(!str2uns(p, &maxFrameLength, MAX_FRAME_MIN, WS_SIZE - 1))
+			fatal("Maximum frame length must be between %d and %d characters", MAX_FRAME_MIN, WS_SIZE - 1);
+	}
+
+	/* Queue aging */
+	if((p = confreadValueBySectKey(configEntry, "general", "queue-aging"))){
+		if(!str2uns(p, &queueAging, QUEUE_AGING_MIN, QUEUE_AGING_MAX))
+			fatal("Queue aging must be between %d and %d milliseconds", QUEUE_AGING_MIN, QUEUE_AGING_MAX);
+	}
+
+	/* Minimum time between reports of each status field */
+	if((p = confreadValueBySectKey(configEntry, "general", "min-emit-interval"))){
+		if(!str2uns(p, &minEmit, 0, MIN_EMIT_INTERVAL_MAX))
+			fatal("Minimum emit interval must be between 0 and %d seconds", MIN_EMIT_INTERVAL_MAX);
+		for(i = 0; i < RC65_FIELDS; i++)
+			fieldMinEmit[i] = minEmit * 1000;
+	}
+
+	/* Change thresholds for status fields defined in their own sections */
+	for(se = confreadGetFirstSection(configEntry); se; se = confreadGetNextSection(se)){
+		String fieldSect = confreadGetSection(se);
+		rc65Field_t f;
+
+		if(!fieldSect || strncmp(fieldSect, FIELD_SECTION_PREFIX, strlen(FIELD_SECTION_PREFIX)))
+			continue;
+		if((f = rc65_field(fieldSect + strlen(FIELD_SECTION_PREFIX))) == RC65_NONE)
+			fatal("Section %s is not for a known RC-65 status field", fieldSect);
+		if((p = confreadValueBySectKey(configEntry, fieldSect, "deadband"))){
+			if(((rc65_kind(f) != RC65_KIND_Temp) && (rc65_kind(f) != RC65_KIND_Uns)) ||
+			(!rc65_parse(f, p, &fieldDeadband[f])) || (fieldDeadband[f] < 0))
+				fatal("Deadband in section %s must be a positive number, and can only be set for numeric fields", fieldSect);
+		}
+		if((p = confreadValueBySectKey(configEntry, fieldSect, "min-emit-interval"))){
+			if(!str2uns(p, &minEmit, 0, MIN_EMIT_INTERVAL_MAX))
+				fatal("Minimum emit interval in section %s must be between 0 and %d seconds", fieldSect, 
+				MIN_EMIT_INTERVAL_MAX);
+			fieldMinEmit[f] = minEmit * 1000;
+		}
+	}
+
+	/* Status cache */
+	if((p = confreadValueBySectKey(configEntry, "general", "max-staleness"))){
+		if(!str2uns(p, &maxStaleness, 0, MAX_STALENESS_MAX))
+			fatal("Max staleness must be between 0 and %d seconds", MAX_STALENESS_MAX);
+		maxStaleness *= 1000;
+	}
+
+	/* Trigger mode */
+	if((p = confreadValueBySectKey(configEntry, "general", "trigger-mode"))){
+		if(!strcmp(p, "legacy"))
+			combinedTriggers = FALSE;
+		else if(!strcmp(p, "combined"))
+			combinedTriggers = TRUE;
+		else
+			fatal("Trigger mode must be either legacy or combined");
+	}
+	if((p = confreadValueBySectKey(configEntry, "general", "coalesce-window"))){
+		if(!str2uns(p, &coalesceWindow, 0, COALESCE_WINDOW_MAX))
+			fatal("Coalesce window must be between 0 and %d milliseconds", COALESCE_WINDOW_MAX);
+	}
+
+	/* Threaded mode */
+	if((p = confreadValueBySectKey(configEntry, "general", "threaded")))
+		threadedMode = str2Bool(p);
+	debug(DEBUG_ACTION, "Number of buses defined: %d, number of zones defined: %d\n", numBuses, numZones);
 		
 
 	/* Turn on library debugging for level 5 */
@@ -1767,9 +3404,11 @@ int main(int argc, char *argv[])
 			notify_logpath(logPath);
 			
 
-		/* Check to see the serial device exists before we fork */
-		if(!serio_check_node(comPort))
-			fatal("Serial device %s does not exist or its permissions are not allowing it to be used.", comPort);
+		/* Check to see the serial devices exist before we fork */
+		for(bus = busEntryHead; bus; bus = bus->next){
+			if(!serio_check_node(bus->comPort))
+				fatal("Serial device %s does not exist or its permissions are not allowing it to be used.", bus->comPort);
+		}
 
 		/* Fork and exit the parent */
 
@@ -1863,20 +3502,64 @@ int main(int argc, char *argv[])
  	signal(SIGTERM, shutdownHandler);
  	signal(SIGINT, shutdownHandler);
 
-	/* Initialize the COM port */
+	/* Initialize the COM ports */
 	
-	if(!(serioStuff = serio_open(comPort, 9600)))
-		fatal("Could not open com port: %s", comPort);
+	for(bus = busEntryHead; bus; bus = bus->next){
+		if(!(bus->serio = serio_open(bus->comPort, 9600)))
+			fatal("Could not open com port: %s", bus->comPort);
 
-
-	/* Flush any partial commands */
-	serio_printf(serioStuff, "\r");
+		/* Flush any partial commands */
+		serio_printf(bus->serio, "\r");
+	}
 	usleep(100000);
-	serio_flush_input(serioStuff);
 
-	/* Ask xPL to monitor our serial fd */
-	if(!xPL_addIODevice(serioHandler, 1234, serio_fd(serioStuff), TRUE, FALSE, FALSE))
-		fatal("Could not register serial I/O fd with xPL");
+	for(bus = busEntryHead; bus; bus = bus->next){
+		serio_flush_input(bus->serio);
+
+		/* Command entries for the bus */
+		busCreatePool(bus);
+
+		/* Ask xPL or the bus thread to monitor the serial fd */
+		busAttach(bus);
+
+		/* Bus timer, the first polls are spread out one poll period apart */
+		if((bus->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0)
+			fatal_with_reason(errno, "timerfd_create");
+		start = monotonicMs();
+		for(i = 0; i < bus->numZones; i++)
+			bus->sched[i].nextPoll = start + ((i + 1) * bus->pollRate * 1000);
+		busPlanPolls(bus);
+		busArmTimer(bus, bus->nextPoll);
+		if(!threadedMode){
+			if(!xPL_addIODevice(busTimerHandler, bus->id, bus->timerfd, TRUE, FALSE, FALSE))
+				fatal("Could not register bus timer fd with xPL");
+		}
+
+		if(threadedMode){
+			/* Rings and wake up fd's between the xPL thread and the bus thread */
+			if(!(bus->cmdRing = spsc_create(CMD_RING_SIZE, sizeof(BusCmd_t))))
+				MALLOC_ERROR;
+			if(!(bus->evRing = spsc_create(EVENT_RING_SIZE, sizeof(BusEvent_t))))
+				MALLOC_ERROR;
+			if((bus->cmdfd = eventfd(0, EFD_NONBLOCK)) < 0)
+				fatal_with_reason(errno, "eventfd");
+			if((bus->evfd = eventfd(0, EFD_NONBLOCK)) < 0)
+				fatal_with_reason(errno, "eventfd");
+			if(!xPL_addIODevice(busEventHandler, bus->id, bus->evfd, TRUE, FALSE, FALSE))
+				fatal("Could not register bus event fd with xPL");
+			if((errno = pthread_create(&bus->thread, NULL, busThread, bus)))
+				fatal_with_reason(errno, "Could not create thread for bus %s", bus->name);
+			debug(DEBUG_STATUS, "Started thread for bus %s", bus->name);
+		}
+	}
+
+	/* Timer for the coalescing window of combined triggers */
+	if((combinedTriggers) && (coalesceWindow)){
+		if((triggerTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0)
+			fatal_with_reason(errno, "timerfd_create");
+		if(!xPL_addIODevice(triggerTimerHandler, 0, triggerTimerFd, TRUE, FALSE, FALSE))
+			fatal("Could not register trigger timer fd with xPL");
+	}
 
 	/* Add 1 second tick service */
 	xPL_addTimeoutHandler(tickHandler, 1, NULL);
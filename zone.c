@@ -0,0 +1,114 @@
+/*
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+* zone.c
+*
+* Per zone poll work done by a bus: finding the zone to poll next, comparing a poll
+* with the last status reported, and adapting the poll interval.
+* Shared by xplrcs.c and zonebench.c.
+*
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "types.h"
+#include "rc65.h"
+#include "zone.h"
+
+/*
+* Find the zone which has been due the longest. Verification polls win ties.
+* stride is the distance in bytes from one schedule entry to the next,
+* sizeof(ZoneSched_t) for an array of them.
+* Returns NULL if n is 0.
+*/
+
+ZoneSchedPtr_t zone_scan(ZoneSchedPtr_t sched, unsigned n, size_t stride)
+{
+	unsigned i;
+	ZoneSchedPtr_t s, next = NULL;
+
+	for(i = 0, s = sched; i < n; i++, s = (ZoneSchedPtr_t) ((char *) s + stride)){
+		if((!next) || (s->nextPoll < next->nextPoll) ||
+		((s->nextPoll == next->nextPoll) && (s->verify) && (!next->verify)))
+			next = s;
+	}
+	return next;
+}
+
+/*
+* Drop changed fields which were reported less than their minimum emit interval ago.
+* They still differ from the last reported status, so a later poll reports them
+* once the interval has passed. Returns the fields to report now.
+*/
+
+static unsigned rate_limit(ZoneStatePtr_t zs, unsigned changed, const unsigned *minEmit, uint64_t now)
+{
+	int f;
+
+	for(f = 0; f < RC65_FIELDS; f++){
+		if(!(changed & RC65_BIT(f)))
+			continue;
+		if((zs->lastEmit[f]) && (now - zs->lastEmit[f] < minEmit[f]))
+			changed &= ~RC65_BIT(f);
+		else
+			zs->lastEmit[f] = now;
+	}
+	return changed;
+}
+
+/*
+* Compare a poll with the last status reported.
+* The fields which moved by more than their deadband are returned through moved.
+* The rate limited ones are kept as the last status reported, and returned.
+* The first poll of a zone is kept as it is, and reports nothing.
+*/
+
+unsigned zone_poll_status(ZoneStatePtr_t zs, const rc65Status_t *st, const int *deadband,
+const unsigned *minEmit, uint64_t now, unsigned *moved)
+{
+	unsigned changed = 0;
+
+	*moved = rc65_changed(&zs->status, st, deadband);
+	if(zs->first_time){
+		zs->status = *st;
+		zs->first_time = FALSE;
+	}
+	else if((changed = rate_limit(zs, *moved, minEmit, now)))
+		rc65_merge(&zs->status, st, changed);
+	return changed;
+}
+
+/*
+* Adapt the poll interval of a zone once a poll is done, and schedule the next poll.
+* Zones which changed go back to the minimum poll interval, and zones which did not change
+* back off towards the maximum poll interval. Dead zones are probed with exponential backoff.
+*/
+
+void zone_poll_done(ZoneSchedPtr_t s, ZoneStatePtr_t zs, Bool changed, uint64_t now, unsigned probeMax)
+{
+	if(zs->health == ZONE_DEAD){
+		s->nextPoll = now + zs->probeInterval;
+		zs->probeInterval = ((zs->probeInterval * 2) < probeMax) ? zs->probeInterval * 2 : probeMax;
+	}
+	else{
+		if(changed)
+			zs->pollInterval = zs->pollMin;
+		else if(zs->pollInterval < zs->pollMax)
+			zs->pollInterval = ((zs->pollInterval * 2) < zs->pollMax) ? zs->pollInterval * 2 : zs->pollMax;
+		s->nextPoll = now + zs->pollInterval;
+	}
+}
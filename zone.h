@@ -0,0 +1,77 @@
+/*
+*    Zone poll state functions
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+*    Zone poll schedule and poll state definitions.
+*
+*
+*/
+
+#ifndef ZONE_H
+#define ZONE_H
+
+#include <stddef.h>
+#include "types.h"
+#include "rc65.h"
+
+/* Zone health */
+typedef enum {ZONE_HEALTHY=0, ZONE_SUSPECT, ZONE_DEAD} ZoneHealth_t;
+
+/* Typedefs. */
+typedef struct zone_sched ZoneSched_t;
+typedef ZoneSched_t * ZoneSchedPtr_t;
+
+typedef struct zone_state ZoneState_t;
+typedef ZoneState_t * ZoneStatePtr_t;
+
+/*
+* Poll schedule entry, owned by the bus.
+* Each bus has an array of these in the same order as its zone entries, so planning
+* the next poll scans a few cache lines instead of every zone entry.
+*/
+
+struct zone_sched {
+	uint64_t nextPoll;
+	Bool verify; /* Waiting for a verification poll */
+};
+
+/*
+* Poll state entry, owned by the bus.
+* Also kept in an array in zone order. It holds everything a poll response compares,
+* updates or rate limits, so handling a poll does not touch the zone entry.
+*/
+
+struct zone_state {
+	ZoneHealth_t health;
+	Bool first_time;
+	unsigned misses;
+	unsigned pollInterval; /* Poll intervals in ms */
+	unsigned pollMin;
+	unsigned pollMax;
+	unsigned probeInterval;
+	rc65Status_t status; /* Last reported poll status */
+	rc65Status_t expect; /* Fields written by basic commands, waiting for a verification poll */
+	uint64_t lastEmit[RC65_FIELDS]; /* When each field was last reported */
+};
+
+/* Prototypes. */
+ZoneSchedPtr_t zone_scan(ZoneSchedPtr_t sched, unsigned n, size_t stride);
+unsigned zone_poll_status(ZoneStatePtr_t zs, const rc65Status_t *st, const int *deadband,
+const unsigned *minEmit, uint64_t now, unsigned *moved);
+void zone_poll_done(ZoneSchedPtr_t s, ZoneStatePtr_t zs, Bool changed, uint64_t now, unsigned probeMax);
+
+#endif
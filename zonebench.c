@@ -0,0 +1,242 @@
+/*
+*    Copyright (C) 2012  Stephen A. Rodgers
+*
+*    This program is free software: you can redistribute it and/or modify
+*    it under the terms of the GNU General Public License as published by
+*    the Free Software Foundation, either version 3 of the License, or
+*    (at your option) any later version.
+*
+*    This program is distributed in the hope that it will be useful,
+*    but WITHOUT ANY WARRANTY; without even the implied warranty of
+*    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*    GNU General Public License for more details.
+*
+*    You should have received a copy of the GNU General Public License
+*    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*
+*
+* zonebench.c
+*
+* Times the poll scan and the poll status diff at 255 zones per bus, with the zone state
+* in the zone entries, and with it in the per bus sched and state arrays used by xplrcs.c.
+* Both layouts run the scan, diff and poll interval code in zone.c, which xplrcs.c uses.
+*
+* Usage: zonebench [buses] [rounds]
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "types.h"
+#include "rc65.h"
+#include "zone.h"
+
+#define ZONES		255
+#define BUSES_DEF	8
+#define ROUNDS_DEF	200
+#define SAMPLES		16
+#define PROBE_MAX	300000
+
+/*
+* Zone entry with the poll schedule and poll state inline, as the zones were laid out
+* before the sched and state arrays. The other members stand in for the configuration,
+* xPL state and command bookkeeping a zone entry keeps.
+*/
+
+typedef struct bench_entry BenchEntry_t;
+typedef BenchEntry_t * BenchEntryPtr_t;
+
+struct bench_entry {
+	String name;
+	uint32_t hash;
+	unsigned address;
+	unsigned queueDepth;
+	void *bus;
+	BenchEntryPtr_t prev;
+	BenchEntryPtr_t next;
+	rc65Status_t cache;
+	uint64_t cacheTime;
+	rc65Status_t trigStatus;
+	unsigned trigChanged;
+	uint64_t trigDue;
+	unsigned depth;
+	unsigned depthMax;
+	ZoneSched_t sched;
+	ZoneState_t state;
+	void *pending[RC65_FIELDS];
+};
+
+/*
+* One bus with both layouts
+*/
+
+typedef struct bench_bus BenchBus_t;
+typedef BenchBus_t * BenchBusPtr_t;
+
+struct bench_bus {
+	BenchEntryPtr_t zones;
+	ZoneSchedPtr_t sched;
+	ZoneStatePtr_t state;
+};
+
+static int deadband[RC65_FIELDS];
+static unsigned minEmit[RC65_FIELDS];
+static rc65Status_t samples[SAMPLES];
+static unsigned long long sink;
+
+/*
+* Return monotonic time in ns
+*/
+
+static uint64_t nowNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/*
+* Decode a set of poll responses which differ a little from each other
+*/
+
+static void makeSamples(void)
+{
+	int i;
+	char line[128];
+
+	for(i = 0; i < SAMPLES; i++){
+		snprintf(line, sizeof(line), "A=0 O=1 Z=1 T=%d SP=70 SPH=68 SPC=76 M=%c FM=%d SM=%c SF=%d H1A=%d H=0 V=0",
+		70 + (i % 5), (i & 4) ? 'C' : 'H', (i >> 3) & 1, (i & 4) ? 'C' : 'H', (i >> 3) & 1, (i % 5) < 3);
+		rc65_decode(line, &samples[i]);
+	}
+}
+
+/*
+* Allocate both layouts for each bus
+*/
+
+static BenchBusPtr_t makeBuses(unsigned buses)
+{
+	unsigned b, i;
+	BenchBusPtr_t bl;
+	BenchEntryPtr_t ze;
+
+	if(!(bl = calloc(buses, sizeof(BenchBus_t))))
+		return NULL;
+	for(b = 0; b < buses; b++){
+		if(!(bl[b].zones = calloc(ZONES, sizeof(BenchEntry_t))) ||
+		!(bl[b].sched = calloc(ZONES, sizeof(ZoneSched_t))) ||
+		!(bl[b].state = calloc(ZONES, sizeof(ZoneState_t))))
+			return NULL;
+		for(i = 0; i < ZONES; i++){
+			ze = &bl[b].zones[i];
+			ze->address = i + 1;
+			ze->state.pollMin = 2000;
+			ze->state.pollMax = 60000;
+			ze->state.pollInterval = ze->state.pollMin;
+			ze->state.status = samples[i % SAMPLES];
+			ze->sched.nextPoll = 1000 + ((i * 7919) % ZONES);
+			ze->next = (i + 1 < ZONES) ? &bl[b].zones[i + 1] : NULL;
+			bl[b].state[i] = ze->state;
+			bl[b].sched[i] = ze->sched;
+		}
+	}
+	return bl;
+}
+
+/*
+* Handle a poll of one zone, the way busSerialReady and busPollDone do
+*/
+
+static unsigned diff(ZoneSchedPtr_t s, ZoneStatePtr_t zs, const rc65Status_t *st, uint64_t now)
+{
+	unsigned moved, changed;
+
+	changed = zone_poll_status(zs, st, deadband, minEmit, now, &moved);
+	zone_poll_done(s, zs, moved ? TRUE : FALSE, now, PROBE_MAX);
+	return changed;
+}
+
+/*
+* Time both layouts and print the results
+*/
+
+int main(int argc, char *argv[])
+{
+	unsigned buses = BUSES_DEF, rounds = ROUNDS_DEF;
+	unsigned b, i, r;
+	uint64_t t, now, scanEntry, scanArray, diffEntryNs, diffArrayNs;
+	BenchBusPtr_t bl;
+	ZoneSchedPtr_t s;
+	BenchEntryPtr_t ze;
+
+	if(argc > 1)
+		buses = (unsigned) atoi(argv[1]);
+	if(argc > 2)
+		rounds = (unsigned) atoi(argv[2]);
+	if((!buses) || (!rounds)){
+		fprintf(stderr, "Usage: %s [buses] [rounds]\n", argv[0]);
+		exit(1);
+	}
+	for(i = 0; i < RC65_FIELDS; i++)
+		minEmit[i] = 5000;
+
+	makeSamples();
+	if(!(bl = makeBuses(buses))){
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	/* Scan, then move the zone found to the back so the next scan finds another one */
+	t = nowNs();
+	for(r = 0; r < rounds; r++){
+		for(b = 0; b < buses; b++){
+			s = zone_scan(&bl[b].zones[0].sched, ZONES, sizeof(BenchEntry_t));
+			s->nextPoll += 60000;
+			sink += ((char *) s - (char *) bl[b].zones) / sizeof(BenchEntry_t);
+		}
+	}
+	scanEntry = nowNs() - t;
+
+	t = nowNs();
+	for(r = 0; r < rounds; r++){
+		for(b = 0; b < buses; b++){
+			s = zone_scan(bl[b].sched, ZONES, sizeof(ZoneSched_t));
+			s->nextPoll += 60000;
+			sink += s - bl[b].sched;
+		}
+	}
+	scanArray = nowNs() - t;
+
+	/* Diff a poll of every zone on every bus each round */
+	t = nowNs();
+	for(r = 0, now = 10000; r < rounds; r++, now += 1000){
+		for(b = 0; b < buses; b++){
+			for(i = 0, ze = bl[b].zones; i < ZONES; i++, ze++)
+				sink += diff(&ze->sched, &ze->state, &samples[(r + i) % SAMPLES], now);
+		}
+	}
+	diffEntryNs = nowNs() - t;
+
+	t = nowNs();
+	for(r = 0, now = 10000; r < rounds; r++, now += 1000){
+		for(b = 0; b < buses; b++){
+			for(i = 0; i < ZONES; i++)
+				sink += diff(&bl[b].sched[i], &bl[b].state[i], &samples[(r + i) % SAMPLES], now);
+		}
+	}
+	diffArrayNs = nowNs() - t;
+
+	printf("%u buses x %d zones, %u rounds\n", buses, ZONES, rounds);
+	printf("zone entry %zu bytes, sched entry %zu bytes, state entry %zu bytes\n",
+	sizeof(BenchEntry_t), sizeof(ZoneSched_t), sizeof(ZoneState_t));
+	printf("scan  entries %8.1f ns/scan   arrays %8.1f ns/scan\n",
+	(double) scanEntry / (rounds * buses), (double) scanArray / (rounds * buses));
+	printf("diff  entries %8.1f ns/zone   arrays %8.1f ns/zone\n",
+	(double) diffEntryNs / ((uint64_t) rounds * buses * ZONES), (double) diffArrayNs / ((uint64_t) rounds * buses * ZONES));
+	printf("checksum %llu\n", sink);
+	return 0;
+}